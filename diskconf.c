@@ -1,45 +1,637 @@
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
 #include <mntent.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
 
 #include "list.h"
+#include "rcu.h"
 #include "util.h"
 #include "diskconf.h"
 #include "diskev.h"
+#include "diskid.h"
+
+/* Rule identity keys, order defines
+ * precedence of same line matches. */
+#define CONF_KEY_DEV 0
+#define CONF_KEY_SERIAL 1
+#define CONF_KEY_LABEL 2
+#define CONF_KEY_UUID 3
+#define CONF_KEY_PARTUUID 4
+#define CONF_KEY_MAX 5
+/* Mount point index follows key indexes */
+#define CONF_IDX_POINT CONF_KEY_MAX
+#define CONF_IDX_MAX (CONF_KEY_MAX + 1)
+
+static const char *conf_key_names[CONF_KEY_MAX] = {
+	[CONF_KEY_DEV] = "DEV",
+	[CONF_KEY_SERIAL] = "SERIAL",
+	[CONF_KEY_LABEL] = "LABEL",
+	[CONF_KEY_UUID] = "UUID",
+	[CONF_KEY_PARTUUID] = "PARTUUID",
+};
 
+/* Parsed config line */
 struct diskdef {
-	char *device;
-	char *serial;
-	char *fs_label;
-	char *fs_uuid;
-	char *part_uuid;
+	int key_type;
+	int flags;
+	char *key;
+	/* Canonical identity of serial or UUIDs */
+	struct diskid id;
 	char *mount_point;
 	char *mount_fs;
 	char *mount_opts;
+	/* Split mount options */
+	unsigned long mount_set;
+	unsigned long mount_clear;
+	char *mount_data;
 	struct list_head list;
 };
 
-LLIST_HEAD(mount_conf);
+/* Key is prefix pattern ("LABEL=backup-*") */
+#define CONF_RULE_PATTERN 0x1
+/* Mount point is template ("/media/%label%") */
+#define CONF_RULE_TEMPLATE 0x2
+/* Options need mount helper ("loop", "offset=") */
+#define CONF_RULE_HELPER 0x4
+/* Other rules mount below this rule's point */
+#define CONF_RULE_NESTED 0x8
+/* Unmount detach policy, lazy detach on EBUSY if neither */
+#define CONF_RULE_DETACH_NEVER 0x10
+#define CONF_RULE_DETACH_ALWAYS 0x20
+/* Filesystem is checked before mount */
+#define CONF_RULE_FSCK 0x40
+
+/* Compiled config rule, strings are
+ * offsets into config string pool. */
+struct diskrule {
+	uint32_t key_type;
+	uint32_t flags;
+	uint32_t key;
+	struct diskid id;
+	uint32_t mount_point;
+	uint32_t mount_fs;
+	uint32_t mount_opts;
+	/* MS_* flags set and cleared by options */
+	uint32_t mount_set;
+	uint32_t mount_clear;
+	uint32_t mount_data;
+	/* Enclosing rule number plus one, zero means none */
+	uint32_t parent;
+	/* Next template of the same literal prefix, plus one */
+	uint32_t tmpl_next;
+};
+
+/* Open addressing hash index of rule
+ * numbers (plus one, zero means empty). */
+struct confidx {
+	uint32_t size;
+	uint32_t *slots;
+};
+
+/* Prefix trie node, children are linked
+ * as siblings; indexes into node array. */
+struct trienode {
+	uint32_t child;
+	uint32_t sibling;
+	/* Rule number plus one, zero means none */
+	uint32_t rule;
+	uint32_t ch;
+};
+
+/* Lookup key of single index */
+struct confkey {
+	const char *str;
+	struct diskid id;
+};
+
+struct diskconf {
+	char *strs;
+	uint32_t strs_len;
+	uint32_t strs_size;
+	/* Interned string offsets, compile time only */
+	uint32_t *strs_hash;
+	uint32_t strs_hash_size;
+	struct diskrule *rules;
+	uint32_t nrules;
+	struct confidx idx[CONF_IDX_MAX];
+	/* Pattern tries, node zero is unused */
+	struct trienode *nodes;
+	uint32_t nnodes;
+	uint32_t nodes_size;
+	uint32_t trie[CONF_IDX_MAX];
+	/* Read-only mapped config image */
+	void *map;
+	size_t map_len;
+};
+
+#define CONF_IMAGE_EXT ".img"
+#define CONF_IMAGE_MAGIC 0x49434d44 /* "DMCI" */
+#define CONF_IMAGE_VERSION 4
+#define CONF_IMAGE_ALIGN 8
+
+/*
+ * Compiled config image, all sections are placed after header
+ * at aligned offsets. Image is valid only for the same source
+ * file state and the same build (structure sizes).
+ */
+struct confimg {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t endian;
+	uint32_t checksum;
+	uint32_t size;
+	uint64_t src_size;
+	uint64_t src_ino;
+	int64_t src_mtime;
+	int64_t src_mtime_ns;
+	uint16_t rule_size;
+	uint16_t node_size;
+	uint32_t strs_off;
+	uint32_t strs_len;
+	uint32_t rules_off;
+	uint32_t nrules;
+	uint32_t nodes_off;
+	uint32_t nnodes;
+	uint32_t trie[CONF_IDX_MAX];
+	uint32_t idx_off[CONF_IDX_MAX];
+	uint32_t idx_size[CONF_IDX_MAX];
+};
+
+/* Mount point template properties */
+#define CONF_TMPL_DEV 0
+#define CONF_TMPL_LABEL 1
+#define CONF_TMPL_SERIAL 2
+#define CONF_TMPL_UUID 3
+#define CONF_TMPL_PARTUUID 4
+#define CONF_TMPL_PARTNUM 5
+#define CONF_TMPL_FSTYPE 6
+#define CONF_TMPL_MAX 7
+
+static const char *conf_tmpl_names[CONF_TMPL_MAX] = {
+	[CONF_TMPL_DEV] = "dev",
+	[CONF_TMPL_LABEL] = "label",
+	[CONF_TMPL_SERIAL] = "serial",
+	[CONF_TMPL_UUID] = "uuid",
+	[CONF_TMPL_PARTUUID] = "partuuid",
+	[CONF_TMPL_PARTNUM] = "partnum",
+	[CONF_TMPL_FSTYPE] = "fstype",
+};
+
+/* Published with rcu_assign_pointer(), readers take
+ * rcu_read_lock() and work on a stable snapshot. */
+static struct diskconf *mount_conf;
+static const char *conf_file;
+
+static inline const char *conf_str(struct diskconf *conf, uint32_t off)
+{
+	return off ? conf->strs + off : NULL;
+}
+
+static uint32_t conf_add_str(struct diskconf *conf, const char *str)
+{
+	uint32_t off;
+	uint32_t pos;
+	size_t len;
+
+	if (!str)
+		return 0;
+
+	/* Same strings share single pool copy */
+	pos = hash_str(str) & (conf->strs_hash_size - 1);
+	while ((off = conf->strs_hash[pos])) {
+		if (!strcmp(conf->strs + off, str))
+			return off;
+		pos = (pos + 1) & (conf->strs_hash_size - 1);
+	}
+
+	len = strlen(str) + 1;
+	while (conf->strs_len + len > conf->strs_size) {
+		conf->strs_size = conf->strs_size ? conf->strs_size * 2 : 4096;
+		conf->strs = realloc(conf->strs, conf->strs_size);
+		if (!conf->strs)
+			die("realloc() failed");
+	}
+
+	off = conf->strs_len;
+	memcpy(conf->strs + off, str, len);
+	conf->strs_len += len;
+	conf->strs_hash[pos] = off;
+
+	return off;
+}
+
+static inline int conf_idx_is_id(int idx)
+{
+	return idx == CONF_KEY_SERIAL || idx == CONF_KEY_UUID ||
+		idx == CONF_KEY_PARTUUID;
+}
+
+/* Exact keys are hashed, patterns go to tries */
+static int conf_rule_indexed(struct diskconf *conf, int idx, struct diskrule *rule)
+{
+	if (idx == CONF_IDX_POINT)
+		return !(rule->flags & CONF_RULE_TEMPLATE);
+	return rule->key_type == idx && !(rule->flags & CONF_RULE_PATTERN);
+}
+
+static void conf_rule_key(struct diskconf *conf, int idx,
+			  struct diskrule *rule, struct confkey *key)
+{
+	key->str = conf_str(conf, idx == CONF_IDX_POINT ?
+			    rule->mount_point : rule->key);
+	key->id = rule->id;
+}
+
+static uint32_t conf_key_hash(int idx, struct confkey *key)
+{
+	if (conf_idx_is_id(idx))
+		return id_hash(&key->id);
+	return hash_str(key->str);
+}
+
+static int conf_key_equal(int idx, struct confkey *a, struct confkey *b)
+{
+	if (conf_idx_is_id(idx))
+		return id_equal(&a->id, a->str, &b->id, b->str);
+	return !strcmp(a->str, b->str);
+}
+
+static void conf_index_build(struct diskconf *conf, int idx)
+{
+	struct confidx *ci = &conf->idx[idx];
+	struct confkey key, cur;
+	uint32_t i, pos, cnt = 0;
+
+	for (i = 0; i < conf->nrules; i++) {
+		if (conf_rule_indexed(conf, idx, &conf->rules[i]))
+			cnt++;
+	}
+
+	/* Keep load factor under one half */
+	ci->size = 8;
+	while (ci->size < cnt * 2)
+		ci->size <<= 1;
+
+	ci->slots = calloc(ci->size, sizeof(*ci->slots));
+	if (!ci->slots)
+		die("calloc() failed");
+
+	for (i = 0; i < conf->nrules; i++) {
+		if (!conf_rule_indexed(conf, idx, &conf->rules[i]))
+			continue;
+
+		conf_rule_key(conf, idx, &conf->rules[i], &key);
+		pos = conf_key_hash(idx, &key) & (ci->size - 1);
+		while (ci->slots[pos]) {
+			/* Earlier rule takes precedence */
+			conf_rule_key(conf, idx, &conf->rules[ci->slots[pos] - 1], &cur);
+			if (conf_key_equal(idx, &cur, &key))
+				break;
+			pos = (pos + 1) & (ci->size - 1);
+		}
+		if (!ci->slots[pos])
+			ci->slots[pos] = i + 1;
+	}
+
+	vdebug("Built %s index, %u rules, %u slots",
+	       idx == CONF_IDX_POINT ? "mount point" : conf_key_names[idx],
+	       cnt, ci->size);
+}
+
+/* Returns rule number matching probe key or -1 */
+static int conf_index_find(struct diskconf *conf, int idx, struct confkey *probe)
+{
+	struct confidx *ci = &conf->idx[idx];
+	struct confkey cur;
+	uint32_t pos;
+
+	pos = conf_key_hash(idx, probe) & (ci->size - 1);
+	while (ci->slots[pos]) {
+		conf_rule_key(conf, idx, &conf->rules[ci->slots[pos] - 1], &cur);
+		if (conf_key_equal(idx, &cur, probe))
+			return ci->slots[pos] - 1;
+		pos = (pos + 1) & (ci->size - 1);
+	}
+
+	return -1;
+}
+
+static uint32_t conf_trie_node(struct diskconf *conf, uint32_t parent, uint32_t ch)
+{
+	struct trienode *node;
+	uint32_t num;
+
+	for (num = conf->nodes[parent].child; num; num = conf->nodes[num].sibling) {
+		if (conf->nodes[num].ch == ch)
+			return num;
+	}
+
+	if (conf->nnodes == conf->nodes_size) {
+		conf->nodes_size *= 2;
+		conf->nodes = realloc(conf->nodes, conf->nodes_size * sizeof(*conf->nodes));
+		if (!conf->nodes)
+			die("realloc() failed");
+	}
+
+	num = conf->nnodes++;
+	node = &conf->nodes[num];
+	node->child = 0;
+	node->rule = 0;
+	node->ch = ch;
+	node->sibling = conf->nodes[parent].child;
+	conf->nodes[parent].child = num;
+
+	return num;
+}
+
+/* Returns node of the added prefix */
+static uint32_t conf_trie_add(struct diskconf *conf, int idx, const char *str,
+			      size_t len, uint32_t rule)
+{
+	uint32_t num;
+
+	if (!conf->trie[idx])
+		conf->trie[idx] = conf_trie_node(conf, 0, 0);
+
+	num = conf->trie[idx];
+	for (; len; str++, len--)
+		num = conf_trie_node(conf, num, (unsigned char)*str);
+
+	/* Earlier rule takes precedence */
+	if (!conf->nodes[num].rule)
+		conf->nodes[num].rule = rule + 1;
+
+	return num;
+}
+
+/*
+ * Returns rule number of the longest matching prefix or -1,
+ * matched prefix length is stored into 'plen'. UUID patterns
+ * are matched against bare hex digits, dashes are skipped.
+ */
+static int conf_trie_find(struct diskconf *conf, int idx, const char *str, int *plen)
+{
+	uint32_t num, next;
+	int len = 0;
+	int best = -1;
+
+	num = conf->trie[idx];
+	if (!num)
+		return -1;
+
+	while (1) {
+		if (conf->nodes[num].rule) {
+			best = conf->nodes[num].rule - 1;
+			*plen = len;
+		}
+
+		if (conf_idx_is_id(idx) && idx != CONF_KEY_SERIAL)
+			while (*str == '-')
+				str++;
+		if (!*str)
+			break;
+
+		for (next = conf->nodes[num].child; next; next = conf->nodes[next].sibling) {
+			if (conf->nodes[next].ch == (unsigned char)*str)
+				break;
+		}
+		if (!next)
+			break;
+
+		num = next;
+		str++;
+		len++;
+	}
+
+	return best;
+}
+
+/*
+ * Links every rule to the closest rule whose fixed mount point
+ * encloses its point, so "/srv/data/archive" and templated
+ * "/srv/data/%label%" depend on "/srv/data". Templated points
+ * are never parents, their final path is not known. Parents
+ * are looked up in point index component by component upwards.
+ */
+static void conf_nest(struct diskconf *conf)
+{
+	struct confkey probe = { .str = NULL };
+	struct diskrule *rule;
+	const char *point;
+	char buf[PATH_MAX];
+	size_t len, pos;
+	uint32_t i;
+	int num;
+
+	for (i = 0; i < conf->nrules; i++) {
+		rule = &conf->rules[i];
+		point = conf_str(conf, rule->mount_point);
+		len = strcspn(point, "%");
+		/* Point is not its own parent */
+		if (!point[len])
+			while (len > 1 && point[len - 1] == '/')
+				len--;
+		if (len >= sizeof(buf))
+			continue;
+		memcpy(buf, point, len);
+
+		for (pos = len; pos > 1 && !rule->parent; pos--) {
+			if (buf[pos - 1] != '/')
+				continue;
+			/* Parent may be written with trailing slash */
+			buf[pos] = '\0';
+			probe.str = buf;
+			num = conf_index_find(conf, CONF_IDX_POINT, &probe);
+			if (num < 0) {
+				buf[pos - 1] = '\0';
+				num = conf_index_find(conf, CONF_IDX_POINT, &probe);
+				buf[pos - 1] = '/';
+			}
+			if (num >= 0 && num != i)
+				rule->parent = num + 1;
+		}
+
+		if (rule->parent)
+			conf->rules[rule->parent - 1].flags |= CONF_RULE_NESTED;
+	}
+}
+
+static struct diskconf *conf_compile(struct list_head *defs)
+{
+	struct diskconf *conf;
+	struct diskrule *rule;
+	struct diskdef *def;
+	uint32_t cnt = 0, num, last;
+	int i;
+
+	conf = calloc(1, sizeof(*conf));
+	if (!conf)
+		die("calloc() failed");
+
+	list_for_each_entry(def, defs, list)
+		cnt++;
+
+	conf->rules = calloc(cnt ? cnt : 1, sizeof(*conf->rules));
+	if (!conf->rules)
+		die("calloc() failed");
+
+	conf->nodes_size = 64;
+	conf->nodes = calloc(conf->nodes_size, sizeof(*conf->nodes));
+	if (!conf->nodes)
+		die("calloc() failed");
+	conf->nnodes = 1;
+
+	/* Every rule holds up to five strings */
+	conf->strs_hash_size = 16;
+	while (conf->strs_hash_size < cnt * 8)
+		conf->strs_hash_size <<= 1;
+	conf->strs_hash = calloc(conf->strs_hash_size, sizeof(*conf->strs_hash));
+	if (!conf->strs_hash)
+		die("calloc() failed");
+
+	/* Zero offset is reserved for missing strings */
+	conf->strs_len = 1;
+	conf->strs_size = 4096;
+	conf->strs = calloc(1, conf->strs_size);
+	if (!conf->strs)
+		die("calloc() failed");
+
+	list_for_each_entry(def, defs, list) {
+		if (def->flags & CONF_RULE_PATTERN)
+			conf_trie_add(conf, def->key_type, def->key,
+				      strlen(def->key), conf->nrules);
+		/* Templates of one prefix are chained in line order */
+		if (def->flags & CONF_RULE_TEMPLATE) {
+			num = conf_trie_add(conf, CONF_IDX_POINT, def->mount_point,
+					    strcspn(def->mount_point, "%"), conf->nrules);
+			last = conf->nodes[num].rule;
+			if (last != conf->nrules + 1) {
+				while (conf->rules[last - 1].tmpl_next)
+					last = conf->rules[last - 1].tmpl_next;
+				conf->rules[last - 1].tmpl_next = conf->nrules + 1;
+			}
+		}
+
+		rule = &conf->rules[conf->nrules++];
+		rule->key_type = def->key_type;
+		rule->flags = def->flags;
+		rule->key = conf_add_str(conf, def->key);
+		rule->id = def->id;
+		rule->mount_point = conf_add_str(conf, def->mount_point);
+		rule->mount_fs = conf_add_str(conf, def->mount_fs);
+		rule->mount_opts = conf_add_str(conf, def->mount_opts);
+		rule->mount_set = def->mount_set;
+		rule->mount_clear = def->mount_clear;
+		rule->mount_data = conf_add_str(conf, def->mount_data);
+	}
+
+	for (i = 0; i < CONF_IDX_MAX; i++)
+		conf_index_build(conf, i);
+
+	conf_nest(conf);
+
+	free(conf->strs_hash);
+	conf->strs_hash = NULL;
+
+	return conf;
+}
+
+static void conf_free(struct diskconf *conf)
+{
+	int i;
+
+	if (conf->map) {
+		munmap(conf->map, conf->map_len);
+		free(conf);
+		return;
+	}
+
+	for (i = 0; i < CONF_IDX_MAX; i++)
+		free(conf->idx[i].slots);
+	free(conf->nodes);
+	free(conf->rules);
+	free(conf->strs);
+	free(conf);
+}
+
+static void conf_free_def(struct diskdef *def)
+{
+	free(def->key);
+	free(def->mount_point);
+	free(def->mount_fs);
+	free(def->mount_opts);
+	free(def->mount_data);
+	free(def);
+}
+
+static int conf_update_pattern(struct diskdef *def, char *key, char *val)
+{
+	struct diskid id;
+	char *pos;
+	size_t len = strlen(val);
+
+	/* Only prefix patterns can be compiled into trie */
+	if (val[len - 1] != '*' || strcspn(val, "*?[") != len - 1) {
+		vwarn("Unsupported device pattern: '%s=%s', only trailing '*' allowed",
+		      key, val);
+		free(key);
+		return 1;
+	}
+	val[len - 1] = '\0';
+
+	def->flags |= CONF_RULE_PATTERN;
+	if (def->key_type == CONF_KEY_SERIAL) {
+		def->key = id_canon_serial(val, &id);
+	} else if (def->key_type == CONF_KEY_UUID ||
+		   def->key_type == CONF_KEY_PARTUUID) {
+		def->key = malloc(len);
+		if (!def->key)
+			die("malloc() failed");
+		for (pos = def->key; *val; val++) {
+			if (*val != '-')
+				*pos++ = tolower((unsigned char)*val);
+		}
+		*pos = '\0';
+	} else {
+		def->key = strdup(val);
+	}
+
+	free(key);
+	return 0;
+}
 
 static int conf_update_device(struct diskdef *def, char *src)
 {
 	char *key;
 	char *val;
+	int i;
 
 	if (!src) {
 		verror("Missing device declaration");
 		return 1;
 	}
 
-	key = strdup(src);
-
 	if (*src == '/') {
-		def->device = key;
+		def->key_type = CONF_KEY_DEV;
+		def->key = strdup(src);
 		return 0;
 	}
 
+	key = strdup(src);
+
 	val = strchr(key, '=');
 	if (!val) {
 		vwarn("Invalid device declaration: '%s'", key);
@@ -56,21 +648,62 @@ static int conf_update_device(struct diskdef *def, char *src)
 	*val = '\0';
 	val++;
 
-	if (!strcmp(key, "DEV"))
-		def->device = val;
-	else if (!strcmp(key, "SERIAL"))
-		def->serial = val;
-	else if (!strcmp(key, "LABEL"))
-		def->fs_label = val;
-	else if (!strcmp(key, "UUID"))
-		def->fs_uuid = val;
-	else if (!strcmp(key, "PARTUUID"))
-		def->part_uuid = val;
+	for (i = 0; i < CONF_KEY_MAX; i++) {
+		if (!strcmp(key, conf_key_names[i]))
+			break;
+	}
+
+	def->key_type = i;
+	if (i < CONF_KEY_MAX && strchr(val, '*'))
+		return conf_update_pattern(def, key, val);
+
+	if (i == CONF_KEY_DEV || i == CONF_KEY_LABEL)
+		def->key = strdup(val);
+	else if (i == CONF_KEY_SERIAL)
+		def->key = id_canon_serial(val, &def->id);
+	else if (i == CONF_KEY_UUID || i == CONF_KEY_PARTUUID)
+		def->key = id_canon_uuid(val, &def->id);
 	else {
 		vwarn("Invalid device definition: '%s'", key);
+		free(key);
 		return 1;
 	}
 
+	free(key);
+	return 0;
+}
+
+static int conf_tmpl_prop(const char *name, size_t len)
+{
+	int i;
+
+	for (i = 0; i < CONF_TMPL_MAX; i++) {
+		if (strlen(conf_tmpl_names[i]) == len &&
+		    !strncmp(conf_tmpl_names[i], name, len))
+			return i;
+	}
+
+	return -1;
+}
+
+static int conf_check_template(const char *src)
+{
+	const char *end;
+
+	while ((src = strchr(src, '%'))) {
+		end = strchr(src + 1, '%');
+		if (!end) {
+			vwarn("Unterminated mount point template: '%s'", src);
+			return 1;
+		}
+		if (conf_tmpl_prop(src + 1, end - src - 1) < 0) {
+			vwarn("Unknown mount point template: '%.*s'",
+			      (int)(end - src + 1), src);
+			return 1;
+		}
+		src = end + 1;
+	}
+
 	return 0;
 }
 
@@ -86,11 +719,143 @@ static int conf_update_mount(struct diskdef *def, char *src)
 		return 1;
 	}
 
+	if (strchr(src, '%')) {
+		if (conf_check_template(src))
+			return 1;
+		def->flags |= CONF_RULE_TEMPLATE;
+	}
+
 	def->mount_point = strdup(src);
 	return 0;
 }
 
-static void conf_add_entry(struct mntent *ent)
+/* Option to MS_* flags, later option wins */
+struct confopt {
+	const char *name;
+	unsigned long set;
+	unsigned long clear;
+};
+
+static const struct confopt conf_opts[] = {
+	{ "defaults", 0, 0 },
+	{ "ro", MS_RDONLY, 0 },
+	{ "rw", 0, MS_RDONLY },
+	{ "nosuid", MS_NOSUID, 0 },
+	{ "suid", 0, MS_NOSUID },
+	{ "nodev", MS_NODEV, 0 },
+	{ "dev", 0, MS_NODEV },
+	{ "noexec", MS_NOEXEC, 0 },
+	{ "exec", 0, MS_NOEXEC },
+	{ "sync", MS_SYNCHRONOUS, 0 },
+	{ "async", 0, MS_SYNCHRONOUS },
+	{ "dirsync", MS_DIRSYNC, 0 },
+	{ "noatime", MS_NOATIME, MS_RELATIME | MS_STRICTATIME },
+	{ "atime", 0, MS_NOATIME },
+	{ "nodiratime", MS_NODIRATIME, 0 },
+	{ "diratime", 0, MS_NODIRATIME },
+	{ "relatime", MS_RELATIME, MS_NOATIME | MS_STRICTATIME },
+	{ "norelatime", 0, MS_RELATIME },
+	{ "strictatime", MS_STRICTATIME, MS_NOATIME | MS_RELATIME },
+	{ "lazytime", MS_LAZYTIME, 0 },
+	{ "nolazytime", 0, MS_LAZYTIME },
+	{ "silent", MS_SILENT, 0 },
+	{ "loud", 0, MS_SILENT },
+	/* Meaningful to mount(8) only */
+	{ "auto", 0, 0 },
+	{ "noauto", 0, 0 },
+	{ "user", 0, 0 },
+	{ "nouser", 0, 0 },
+	{ "users", 0, 0 },
+	{ "owner", 0, 0 },
+	{ "group", 0, 0 },
+	{ "nofail", 0, 0 },
+	{ "_netdev", 0, 0 },
+};
+
+/* Options only mount helper can carry out */
+static const char *conf_helper_opts[] = {
+	"loop", "offset", "sizelimit", "encryption",
+	"helper", "bind", "rbind", "move", "remount",
+};
+
+static int conf_opt_is(const char *opt, size_t len, const char *name)
+{
+	return strlen(name) == len && !strncmp(opt, name, len);
+}
+
+/*
+ * Splits options into MS_* flags and filesystem data
+ * string once, so mounts do not have to parse them.
+ */
+static void conf_split_opts(struct diskdef *def)
+{
+	const char *opt = def->mount_opts;
+	char data[PATH_MAX];
+	size_t len, nlen, dlen = 0;
+	unsigned int i;
+
+	for (; *opt; opt += len + !!opt[len]) {
+		len = strcspn(opt, ",");
+		if (!len)
+			continue;
+		/* Name part of "name=value" */
+		nlen = strcspn(opt, ",=");
+
+		for (i = 0; i < sizeof(conf_opts) / sizeof(conf_opts[0]); i++) {
+			if (conf_opt_is(opt, len, conf_opts[i].name))
+				break;
+		}
+		if (i < sizeof(conf_opts) / sizeof(conf_opts[0])) {
+			def->mount_set &= ~conf_opts[i].clear;
+			def->mount_clear &= ~conf_opts[i].set;
+			def->mount_set |= conf_opts[i].set;
+			def->mount_clear |= conf_opts[i].clear;
+			continue;
+		}
+
+		for (i = 0; i < sizeof(conf_helper_opts) / sizeof(conf_helper_opts[0]); i++) {
+			if (conf_opt_is(opt, nlen, conf_helper_opts[i]))
+				def->flags |= CONF_RULE_HELPER;
+		}
+
+		if (conf_opt_is(opt, nlen, "x-diskmount.detach")) {
+			def->flags &= ~(CONF_RULE_DETACH_NEVER | CONF_RULE_DETACH_ALWAYS);
+			if (conf_opt_is(opt, len, "x-diskmount.detach=never"))
+				def->flags |= CONF_RULE_DETACH_NEVER;
+			else if (conf_opt_is(opt, len, "x-diskmount.detach=always"))
+				def->flags |= CONF_RULE_DETACH_ALWAYS;
+			else if (!conf_opt_is(opt, len, "x-diskmount.detach=busy"))
+				warn("Unknown detach policy '%.*s'", (int)len, opt);
+			continue;
+		}
+
+		if (conf_opt_is(opt, len, "x-diskmount.fsck")) {
+			def->flags |= CONF_RULE_FSCK;
+			continue;
+		}
+
+		/* Userspace annotations */
+		if (!strncmp(opt, "x-", 2) || conf_opt_is(opt, nlen, "comment"))
+			continue;
+
+		if (dlen + len + 2 > sizeof(data)) {
+			warn("Mount options too long: '%s'", def->mount_opts);
+			def->flags |= CONF_RULE_HELPER;
+			break;
+		}
+		if (dlen)
+			data[dlen++] = ',';
+		memcpy(data + dlen, opt, len);
+		dlen += len;
+	}
+
+	if (dlen) {
+		data[dlen] = '\0';
+		def->mount_data = strdup(data);
+	}
+}
+
+static void conf_add_entry(struct list_head *defs, struct mntent *ent)
 {
 	struct diskdef *def;
 
@@ -111,11 +876,13 @@ static void conf_add_entry(struct mntent *ent)
 
 	if (!strlen(ent->mnt_opts))
 		goto done;
-	if (strcmp(ent->mnt_opts, "-"))
+	if (strcmp(ent->mnt_opts, "-")) {
 		def->mount_opts = strdup(ent->mnt_opts);
+		conf_split_opts(def);
+	}
 
 done:
-	list_add_tail(&def->list, &mount_conf);
+	list_add_tail(&def->list, defs);
 	vinfo("Stored mount: '%s' -> '%s'",
 	      ent->mnt_fsname, ent->mnt_dir);
 	return;
@@ -123,124 +890,761 @@ done:
 fail:
 	warn("Skipped invalid mount: '%s' -> '%s'",
 	     ent->mnt_fsname, ent->mnt_dir);
-	free(def);
+	conf_free_def(def);
 }
 
-static int conf_load_file(const char *file_name)
+static struct diskconf *conf_load_file(const char *file_name)
 {
 	FILE *fp;
 	struct mntent *ent;
+	struct diskdef *def, *tmp;
+	struct diskconf *conf;
+	LLIST_HEAD(defs);
 
 	fp = setmntent(file_name, "r");
 	if (!fp) {
 		debug("Cannot read: '%s'", file_name);
-		return -1;
+		return NULL;
 	}
 
 	vinfo("Loading config: '%s'", file_name);
 
 	while (NULL != (ent = getmntent(fp))) {
-		conf_add_entry(ent);
+		conf_add_entry(&defs, ent);
 	}
 	endmntent(fp);
 
+	conf = conf_compile(&defs);
+
+	list_for_each_entry_safe(def, tmp, &defs, list)
+		conf_free_def(def);
+
+	return conf;
+}
+
+static uint32_t conf_image_sum(const unsigned char *data, size_t len)
+{
+	uint32_t sum = 2166136261u;
+
+	while (len--)
+		sum = (sum ^ *data++) * 16777619u;
+
+	return sum;
+}
+
+static inline uint32_t conf_image_align(uint32_t off)
+{
+	return (off + CONF_IMAGE_ALIGN - 1) & ~(CONF_IMAGE_ALIGN - 1);
+}
+
+static int conf_image_fresh(struct confimg *img, struct stat *st)
+{
+	return img->src_size == st->st_size &&
+		img->src_ino == st->st_ino &&
+		img->src_mtime == st->st_mtim.tv_sec &&
+		img->src_mtime_ns == st->st_mtim.tv_nsec;
+}
+
+static int conf_image_section(struct confimg *img, uint32_t off, uint64_t len)
+{
+	return off < sizeof(*img) || off > img->size || len > img->size - off;
+}
+
+static int conf_image_bad(struct confimg *img)
+{
+	int i;
+
+	if (conf_image_section(img, img->strs_off, img->strs_len) ||
+	    conf_image_section(img, img->rules_off,
+			       (uint64_t)img->nrules * img->rule_size) ||
+	    conf_image_section(img, img->nodes_off,
+			       (uint64_t)img->nnodes * img->node_size))
+		return 1;
+
+	for (i = 0; i < CONF_IDX_MAX; i++) {
+		if (conf_image_section(img, img->idx_off[i],
+				       (uint64_t)img->idx_size[i] * sizeof(uint32_t)))
+			return 1;
+	}
+
 	return 0;
 }
 
+static int conf_image_write(struct diskconf *conf, const char *file_name)
+{
+	struct confimg *img;
+	struct stat st;
+	char *path, *tmp;
+	char *buf;
+	uint32_t off;
+	int i, fd;
+	int ret = -1;
+
+	if (stat(file_name, &st)) {
+		error("Cannot stat config '%s'", file_name);
+		return -1;
+	}
+
+	/* Lay out sections after header */
+	off = conf_image_align(sizeof(*img));
+	off = conf_image_align(off + conf->strs_len);
+	off = conf_image_align(off + conf->nrules * sizeof(*conf->rules));
+	off = conf_image_align(off + conf->nnodes * sizeof(*conf->nodes));
+	for (i = 0; i < CONF_IDX_MAX; i++)
+		off = conf_image_align(off + conf->idx[i].size * sizeof(uint32_t));
+
+	buf = calloc(1, off);
+	if (!buf)
+		die("calloc() failed");
+
+	img = (struct confimg *)buf;
+	img->magic = CONF_IMAGE_MAGIC;
+	img->version = CONF_IMAGE_VERSION;
+	img->endian = 0x0102;
+	img->size = off;
+	img->src_size = st.st_size;
+	img->src_ino = st.st_ino;
+	img->src_mtime = st.st_mtim.tv_sec;
+	img->src_mtime_ns = st.st_mtim.tv_nsec;
+	img->rule_size = sizeof(*conf->rules);
+	img->node_size = sizeof(*conf->nodes);
+
+	off = conf_image_align(sizeof(*img));
+	img->strs_off = off;
+	img->strs_len = conf->strs_len;
+	memcpy(buf + off, conf->strs, conf->strs_len);
+
+	off = conf_image_align(off + conf->strs_len);
+	img->rules_off = off;
+	img->nrules = conf->nrules;
+	memcpy(buf + off, conf->rules, conf->nrules * sizeof(*conf->rules));
+
+	off = conf_image_align(off + conf->nrules * sizeof(*conf->rules));
+	img->nodes_off = off;
+	img->nnodes = conf->nnodes;
+	memcpy(buf + off, conf->nodes, conf->nnodes * sizeof(*conf->nodes));
+
+	off = conf_image_align(off + conf->nnodes * sizeof(*conf->nodes));
+	for (i = 0; i < CONF_IDX_MAX; i++) {
+		img->trie[i] = conf->trie[i];
+		img->idx_off[i] = off;
+		img->idx_size[i] = conf->idx[i].size;
+		memcpy(buf + off, conf->idx[i].slots, conf->idx[i].size * sizeof(uint32_t));
+		off = conf_image_align(off + conf->idx[i].size * sizeof(uint32_t));
+	}
+
+	img->checksum = conf_image_sum((unsigned char *)buf + sizeof(*img),
+				       img->size - sizeof(*img));
+
+	/* Replace image atomically, daemon may map it any time */
+	path = strfdup("%s" CONF_IMAGE_EXT, file_name);
+	tmp = strfdup("%s.tmp", path);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		error("Cannot create image '%s': %s", tmp, strerror(errno));
+		goto out;
+	}
+	if (write(fd, buf, img->size) != img->size || fsync(fd)) {
+		error("Cannot write image '%s': %s", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+
+	if (rename(tmp, path)) {
+		error("Cannot install image '%s': %s", path, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+
+	info("Compiled config '%s' -> '%s', %u rules, %u bytes",
+	     file_name, path, conf->nrules, img->size);
+	ret = 0;
+out:
+	free(path);
+	free(tmp);
+	free(buf);
+	return ret;
+}
+
+static struct diskconf *conf_image_load(const char *file_name)
+{
+	struct diskconf *conf;
+	struct confimg *img;
+	struct stat st, ist;
+	char *path;
+	void *map;
+	int i, fd;
+
+	if (stat(file_name, &st))
+		return NULL;
+
+	path = strfdup("%s" CONF_IMAGE_EXT, file_name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		free(path);
+		return NULL;
+	}
+
+	if (fstat(fd, &ist) || ist.st_size < sizeof(*img)) {
+		vwarn("Invalid config image '%s'", path);
+		goto fail_fd;
+	}
+
+	map = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		vwarn("Cannot map config image '%s'", path);
+		goto fail_fd;
+	}
+	close(fd);
+
+	img = map;
+	if (img->magic != CONF_IMAGE_MAGIC || img->version != CONF_IMAGE_VERSION ||
+	    img->endian != 0x0102 || img->size != ist.st_size ||
+	    img->rule_size != sizeof(struct diskrule) ||
+	    img->node_size != sizeof(struct trienode)) {
+		info("Incompatible config image '%s', using text config", path);
+		goto fail_map;
+	}
+
+	if (conf_image_bad(img)) {
+		warn("Corrupted config image '%s', using text config", path);
+		goto fail_map;
+	}
+
+	if (!conf_image_fresh(img, &st)) {
+		info("Stale config image '%s', using text config", path);
+		goto fail_map;
+	}
+
+	if (img->checksum != conf_image_sum((unsigned char *)map + sizeof(*img),
+					    img->size - sizeof(*img))) {
+		warn("Corrupted config image '%s', using text config", path);
+		goto fail_map;
+	}
+
+	conf = calloc(1, sizeof(*conf));
+	if (!conf)
+		die("calloc() failed");
+
+	conf->map = map;
+	conf->map_len = ist.st_size;
+	conf->strs = (char *)map + img->strs_off;
+	conf->strs_len = img->strs_len;
+	conf->rules = (struct diskrule *)((char *)map + img->rules_off);
+	conf->nrules = img->nrules;
+	conf->nodes = (struct trienode *)((char *)map + img->nodes_off);
+	conf->nnodes = img->nnodes;
+	for (i = 0; i < CONF_IDX_MAX; i++) {
+		conf->trie[i] = img->trie[i];
+		conf->idx[i].slots = (uint32_t *)((char *)map + img->idx_off[i]);
+		conf->idx[i].size = img->idx_size[i];
+	}
+
+	info("Mapped config image '%s', %u rules", path, conf->nrules);
+	free(path);
+	return conf;
+
+fail_map:
+	munmap(map, ist.st_size);
+	free(path);
+	return NULL;
+fail_fd:
+	close(fd);
+	free(path);
+	return NULL;
+}
+
+/* Prefer compiled image, unless it is outdated */
+static struct diskconf *conf_load_any(const char *file_name)
+{
+	struct diskconf *conf;
+
+	conf = conf_image_load(file_name);
+	if (conf)
+		return conf;
+
+	return conf_load_file(file_name);
+}
+
 int conf_load(void)
 {
-	if (!conf_load_file("/etc/disktab"))
-		return 0;
+	static const char *files[] = { "/etc/disktab", "diskmount.conf", NULL };
+	int i;
 
-	if (!conf_load_file("diskmount.conf"))
-		return 0;
+	for (i = 0; files[i]; i++) {
+		mount_conf = conf_load_any(files[i]);
+		if (mount_conf) {
+			conf_file = files[i];
+			return 0;
+		}
+	}
 
 	die("No disk config found");
 	return -1;
 }
 
+int conf_compile_image(void)
+{
+	struct diskconf *conf;
+
+	conf_load();
+
+	/* Always compile from text source */
+	if (mount_conf->map) {
+		conf = conf_load_file(conf_file);
+		if (!conf)
+			return -1;
+		conf_free(mount_conf);
+		mount_conf = conf;
+	}
+
+	return conf_image_write(mount_conf, conf_file);
+}
+
+const char *conf_path(void)
+{
+	return conf_file;
+}
+
+struct diskconf *conf_reload(void)
+{
+	struct diskconf *conf;
+	struct diskconf *old;
+
+	/* New config is compiled aside, current
+	 * one stays in use on any failure. */
+	conf = conf_load_any(conf_file);
+	if (!conf) {
+		warn("Failed to reload config '%s', keeping current", conf_file);
+		return NULL;
+	}
+
+	old = mount_conf;
+	rcu_assign_pointer(mount_conf, conf);
+
+	info("Reloaded config '%s', %u rules", conf_file, conf->nrules);
+
+	return old;
+}
+
+static void conf_free_rcu(void *ptr)
+{
+	conf_free(ptr);
+}
+
+void conf_release(struct diskconf *conf)
+{
+	/* Readers may still walk old snapshot */
+	call_rcu(conf, conf_free_rcu);
+}
+
+int conf_watch(void)
+{
+	char *dir;
+	int fd;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		warn("Cannot watch config changes: %s", strerror(errno));
+		return -1;
+	}
+
+	/* Editors replace file, watch directory */
+	dir = strdup(conf_file);
+	if (inotify_add_watch(fd, dirname(dir),
+			      IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+		warn("Cannot watch config '%s': %s", conf_file, strerror(errno));
+		free(dir);
+		close(fd);
+		return -1;
+	}
+	free(dir);
+
+	vdebug("Watching config '%s', fd %i", conf_file, fd);
+
+	return fd;
+}
+
+int conf_watch_check(int fd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ie;
+	const char *name;
+	ssize_t len;
+	char *pos;
+	int changed = 0;
+
+	name = strrchr(conf_file, '/');
+	name = name ? name + 1 : conf_file;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (pos = buf; pos < buf + len; pos += sizeof(*ie) + ie->len) {
+			ie = (struct inotify_event *)pos;
+			if (ie->len && !strcmp(ie->name, name))
+				changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+/*
+ * Path has shape of expanded template: fixed parts verbatim,
+ * each property a non-empty run without '/', as expansion
+ * replaces slashes in values.
+ */
+static int conf_tmpl_match(const char *tmpl, const char *path)
+{
+	const char *end;
+
+	while (*tmpl) {
+		if (*tmpl != '%') {
+			if (*tmpl++ != *path++)
+				return 0;
+			continue;
+		}
+
+		end = strchr(tmpl + 1, '%');
+		if (!end)
+			return 0;
+		tmpl = end + 1;
+
+		if (!*path || *path == '/')
+			return 0;
+		for (path++; ; path++) {
+			if (conf_tmpl_match(tmpl, path))
+				return 1;
+			if (!*path || *path == '/')
+				return 0;
+		}
+	}
+
+	return !*path;
+}
+
+/*
+ * Templates hang off trie node of their literal prefix, so only
+ * ones whose prefix lies on the path are tried: longest prefix
+ * first, then line order.
+ */
+static int conf_tmpl_find(struct diskconf *conf, const char *point)
+{
+	uint32_t path[strlen(point) + 1];
+	uint32_t num, next, rule;
+	const char *str = point;
+	int cnt = 0;
+
+	num = conf->trie[CONF_IDX_POINT];
+	while (num) {
+		if (conf->nodes[num].rule)
+			path[cnt++] = num;
+		if (!*str)
+			break;
+		for (next = conf->nodes[num].child; next; next = conf->nodes[next].sibling) {
+			if (conf->nodes[next].ch == (unsigned char)*str)
+				break;
+		}
+		num = next;
+		str++;
+	}
+
+	while (cnt--) {
+		for (rule = conf->nodes[path[cnt]].rule; rule;
+		     rule = conf->rules[rule - 1].tmpl_next) {
+			if (conf_tmpl_match(conf_str(conf, conf->rules[rule - 1].mount_point), point))
+				return rule - 1;
+		}
+	}
+
+	return -1;
+}
+
+/* Rule owning mount point, fixed or expanded from template */
+static int conf_point_rule(struct diskconf *conf, const char *point)
+{
+	struct confkey probe = { .str = point };
+	int num;
+
+	num = conf_index_find(conf, CONF_IDX_POINT, &probe);
+	if (num >= 0)
+		return num;
+
+	return conf_tmpl_find(conf, point);
+}
+
 int conf_has_mount(char *point)
 {
-	struct diskdef *def;
+	struct diskconf *conf;
+	int ret;
+
+	rcu_read_lock();
+	conf = rcu_dereference(mount_conf);
+	ret = conf_point_rule(conf, point) >= 0;
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/* Unmount detach policy of rule owning mount point */
+int conf_point_detach(const char *point)
+{
+	struct diskconf *conf;
+	int num, ret = CONF_DETACH_BUSY;
+
+	rcu_read_lock();
+	conf = rcu_dereference(mount_conf);
+	num = conf_point_rule(conf, point);
+	if (num >= 0 && (conf->rules[num].flags & CONF_RULE_DETACH_NEVER))
+		ret = CONF_DETACH_NEVER;
+	else if (num >= 0 && (conf->rules[num].flags & CONF_RULE_DETACH_ALWAYS))
+		ret = CONF_DETACH_ALWAYS;
+	rcu_read_unlock();
+
+	return ret;
+}
+
+int conf_walk_points(conf_point_cb cb, void *arg)
+{
+	struct diskconf *conf;
+	uint32_t i;
+	int ret = 0;
+
+	rcu_read_lock();
+	conf = rcu_dereference(mount_conf);
+	/* Templated mount points cannot be listed */
+	for (i = 0; i < conf->nrules; i++) {
+		if (conf->rules[i].flags & CONF_RULE_TEMPLATE) {
+			ret = -1;
+			goto out;
+		}
+	}
 
-	list_for_each_entry(def, &mount_conf, list) {
-		if (!strcmp(def->mount_point, point))
+	for (i = 0; i < conf->nrules; i++)
+		cb(conf_str(conf, conf->rules[i].mount_point), arg);
+out:
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static const char *conf_evt_value(struct diskev *evt, int prop)
+{
+	const char *val;
+
+	switch (prop) {
+	case CONF_TMPL_DEV:
+		val = evt->device ? strrchr(evt->device, '/') : NULL;
+		return val ? val + 1 : evt->device;
+	case CONF_TMPL_LABEL:
+		return evt->label;
+	case CONF_TMPL_SERIAL:
+		return evt->serial;
+	case CONF_TMPL_UUID:
+		return evt->fsuuid;
+	case CONF_TMPL_PARTUUID:
+		return evt->partuuid;
+	case CONF_TMPL_PARTNUM:
+		return evt->partnum;
+	case CONF_TMPL_FSTYPE:
+		return evt->filesys;
+	}
+
+	return NULL;
+}
+
+static int conf_expand(const char *tmpl, struct diskev *evt, char *buf, size_t size)
+{
+	const char *end, *val;
+	char *last = buf + size - 1;
+	char *start;
+
+	while (*tmpl && buf < last) {
+		if (*tmpl != '%') {
+			*buf++ = *tmpl++;
+			continue;
+		}
+
+		end = strchr(tmpl + 1, '%');
+		val = conf_evt_value(evt, conf_tmpl_prop(tmpl + 1, end - tmpl - 1));
+		if (!val || !*val || !strcmp(val, ".") || !strcmp(val, "..")) {
+			vwarn("Missing '%.*s' template property, device '%s'",
+			      (int)(end - tmpl + 1), tmpl, evt->device);
 			return 1;
+		}
+
+		/* Property cannot escape mount directory */
+		for (start = buf; *val && buf < last; val++)
+			*buf++ = *val == '/' ? '_' : *val;
+		if (buf == start)
+			return 1;
+
+		tmpl = end + 1;
 	}
 
+	if (*tmpl) {
+		vwarn("Too long mount point, device '%s'", evt->device);
+		return 1;
+	}
+
+	*buf = '\0';
 	return 0;
 }
 
-int conf_find(struct diskev *evt, char **mpoint, char **mfs, char **mopts)
+static void conf_evt_key(struct diskev *evt, int idx, struct confkey *key)
 {
-	struct diskdef *tmp;
-	struct diskdef *def = NULL;
+	memset(key, 0, sizeof(*key));
 
-	list_for_each_entry(tmp, &mount_conf, list) {
-		def = tmp;
-		if (tmp->device) {
-			if (evt->device && !strcmp(tmp->device, evt->device))
-				break;
-		} else if (tmp->serial) {
-			if (evt->serial && !strcmp(tmp->serial, evt->serial))
-				break;
-		} else if (tmp->fs_label) {
-			if (evt->label && !strcmp(tmp->fs_label, evt->label))
-				break;
-		} else if (tmp->fs_uuid) {
-			if (evt->fsuuid && !strcmp(tmp->fs_uuid, evt->fsuuid))
-				break;
-		} else if (tmp->part_uuid) {
-			if (evt->partuuid && !strcmp(tmp->part_uuid, evt->partuuid))
-				break;
+	if (idx == CONF_KEY_DEV) {
+		key->str = evt->device;
+	} else if (idx == CONF_KEY_LABEL) {
+		key->str = evt->label;
+	} else if (idx == CONF_KEY_SERIAL) {
+		key->str = evt->serial;
+		key->id = evt->serial_id;
+	} else if (idx == CONF_KEY_UUID) {
+		key->str = evt->fsuuid;
+		key->id = evt->fsuuid_id;
+	} else if (idx == CONF_KEY_PARTUUID) {
+		key->str = evt->partuuid;
+		key->id = evt->partuuid_id;
+	}
+}
+
+/*
+ * Match precedence:
+ *  1. exact keys, first matching config line wins;
+ *  2. prefix patterns, longest matching prefix wins,
+ *     equal length prefixes resolved by config line.
+ */
+static int conf_match(struct diskconf *conf, struct diskev *evt)
+{
+	struct confkey probe;
+	int i, num, len, best = -1, best_len = -1;
+
+	for (i = 0; i < CONF_KEY_MAX; i++) {
+		conf_evt_key(evt, i, &probe);
+		if (!probe.str || (conf_idx_is_id(i) && !probe.id.kind))
+			continue;
+
+		num = conf_index_find(conf, i, &probe);
+		if (num >= 0 && (best < 0 || num < best))
+			best = num;
+	}
+
+	if (best >= 0)
+		return best;
+
+	for (i = 0; i < CONF_KEY_MAX; i++) {
+		conf_evt_key(evt, i, &probe);
+		if (!probe.str)
+			continue;
+
+		num = conf_trie_find(conf, i, probe.str, &len);
+		if (num < 0)
+			continue;
+		if (len > best_len || (len == best_len && num < best)) {
+			best = num;
+			best_len = len;
 		}
-		def = NULL;
 	}
 
-	*mpoint = '\0';
-	*mfs = '\0';
-	*mopts = '\0';
+	return best;
+}
+
+int conf_find(struct diskev *evt, struct diskmatch *match)
+{
+	int ret;
+
+	rcu_read_lock();
+	ret = conf_find_at(rcu_dereference(mount_conf), evt, match);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static const char *conf_copy_str(struct diskconf *conf, uint32_t off,
+				 char *buf, size_t size)
+{
+	if (!off)
+		return NULL;
+	snprintf(buf, size, "%s", conf_str(conf, off));
+	return buf;
+}
+
+int conf_find_at(struct diskconf *conf, struct diskev *evt, struct diskmatch *match)
+{
+	struct diskrule *def;
+	const char *point;
+	int num;
+
+	memset(match, 0, sizeof(*match));
 
-	if (!def) {
+	num = conf_match(conf, evt);
+	if (num < 0) {
 		vwarn("No mount config for device: '%s'",
 		      evt->device ? evt->device : "N/A");
 		return 1;
 	}
 
-	if (def->mount_point)
-		*mpoint = def->mount_point;
-	if (def->mount_fs)
-		*mfs = def->mount_fs;
-	if (def->mount_opts)
-		*mopts = def->mount_opts;
+	def = &conf->rules[num];
+	point = conf_str(conf, def->mount_point);
+	match->rule = num;
+
+	if (def->flags & CONF_RULE_TEMPLATE) {
+		if (conf_expand(point, evt, match->point, sizeof(match->point)))
+			return 1;
+		vdebug("Expanded mount point '%s' -> '%s'", point, match->point);
+	} else {
+		snprintf(match->point, sizeof(match->point), "%s", point);
+	}
+
+	match->fs = conf_copy_str(conf, def->mount_fs,
+				  match->fs_buf, sizeof(match->fs_buf));
+	match->opts = conf_copy_str(conf, def->mount_opts,
+				    match->opts_buf, sizeof(match->opts_buf));
+	match->data = conf_copy_str(conf, def->mount_data,
+				    match->data_buf, sizeof(match->data_buf));
+	match->flags_set = def->mount_set;
+	match->flags_clear = def->mount_clear;
+	match->helper = !!(def->flags & CONF_RULE_HELPER);
+	match->nested = !!(def->flags & CONF_RULE_NESTED);
+	match->fsck = !!(def->flags & CONF_RULE_FSCK);
+	if (def->parent)
+		match->parent = conf_copy_str(conf, conf->rules[def->parent - 1].mount_point,
+					      match->parent_buf, sizeof(match->parent_buf));
 
 	return 0;
 }
 
 void conf_dump(FILE *fp)
 {
-	struct diskdef *def;
+	struct diskconf *conf = rcu_dereference(mount_conf);
+	struct diskrule *def;
+	const char *key;
+	uint32_t i;
+	int len;
 
 	fprintf(fp, "Mount config:\n");
-	list_for_each_entry(def, &mount_conf, list) {
-		if (def->device) {
-			fprintf(fp, "DEV=%-28s", def->device);
-		} else if (def->serial) {
-			fprintf(fp, "SERIAL=%-25s", def->serial);
-		} else if (def->fs_label) {
-			fprintf(fp, "LABEL=%-26s", def->fs_label);
-		} else if (def->fs_uuid) {
-			fprintf(fp, "UUID=%-27s", def->fs_uuid);
-		} else if (def->part_uuid) {
-			fprintf(fp, "PARTUUID=%-23s", def->part_uuid);
-		}
+	fprintf(fp, "# Precedence: exact keys by line order, "
+		"then patterns by longest prefix and line order\n");
+	for (i = 0; i < conf->nrules; i++) {
+		def = &conf->rules[i];
+		key = conf_key_names[def->key_type];
+		if (def->flags & CONF_RULE_PATTERN)
+			len = fprintf(fp, "%s=%s*", key, conf_str(conf, def->key));
+		else
+			len = fprintf(fp, "%s=%s", key, conf_str(conf, def->key));
+		fprintf(fp, "%*s", len < 32 ? 32 - len : 1, "");
 
 		if (def->mount_point)
-			fprintf(fp, "%-16s", def->mount_point);
+			fprintf(fp, "%-16s", conf_str(conf, def->mount_point));
 		if (def->mount_fs)
-			fprintf(fp, "%-8s", def->mount_fs);
+			fprintf(fp, "%-8s", conf_str(conf, def->mount_fs));
 		if (def->mount_opts)
-			fprintf(fp, "%s", def->mount_opts);
+			fprintf(fp, "%s", conf_str(conf, def->mount_opts));
 
 		fprintf(fp, "\n");
 	}
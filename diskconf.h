@@ -1,11 +1,58 @@
 #ifndef _DISKCONF_H
 #define _DISKCONF_H
 
+#include <limits.h>
+
 #include "diskev.h"
 
+/* Copied out of config snapshot, stays
+ * valid after config is replaced. */
+struct diskmatch {
+	/* Expanded mount point */
+	char point[PATH_MAX];
+	/* Point to buffers below or NULL if unset */
+	const char *fs;
+	const char *opts;
+	/* Options split into MS_* flags and fs data */
+	const char *data;
+	unsigned long flags_set;
+	unsigned long flags_clear;
+	/* Options need mount helper */
+	int helper;
+	/* Enclosing rule point or NULL; other rules nest below */
+	const char *parent;
+	int nested;
+	/* Check filesystem before mount */
+	int fsck;
+	char fs_buf[NAME_MAX + 1];
+	char opts_buf[PATH_MAX];
+	char data_buf[PATH_MAX];
+	char parent_buf[PATH_MAX];
+	/* Matched rule number */
+	int rule;
+};
+
+/* Unmount detach policy, "x-diskmount.detach=" option */
+#define CONF_DETACH_NEVER 0
+#define CONF_DETACH_BUSY 1
+#define CONF_DETACH_ALWAYS 2
+
+struct diskconf;
+
+typedef void (*conf_point_cb)(const char *point, void *arg);
+
 int conf_load(void);
-int conf_find(struct diskev *evt, char **mpoint, char **mfs, char **mopts);
+int conf_compile_image(void);
+const char *conf_path(void);
+struct diskconf *conf_reload(void);
+void conf_release(struct diskconf *conf);
+int conf_watch(void);
+int conf_watch_check(int fd);
+int conf_find(struct diskev *evt, struct diskmatch *match);
+int conf_find_at(struct diskconf *conf, struct diskev *evt, struct diskmatch *match);
 int conf_has_mount(char *point);
+int conf_point_detach(const char *point);
+int conf_walk_points(conf_point_cb cb, void *arg);
 void conf_dump(FILE *fp);
 
 #endif // _DISKCONF_H
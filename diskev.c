@@ -3,7 +3,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #ifdef WITH_LIBBLKID
 #include <blkid/blkid.h>
@@ -15,6 +17,12 @@
 
 LLIST_HEAD(event_queue);
 
+static inline uint64_t ev_now(void)
+{
+	return mono_usec() / 1000;
+}
+
+/* Delay is in milliseconds */
 void ev_insert(struct diskev *evt, off_t delay)
 {
 	struct diskev *tmp;
@@ -24,9 +32,9 @@ void ev_insert(struct diskev *evt, off_t delay)
 		die("malloc() failed");
 
 	memcpy(tmp, evt, sizeof(*tmp));
-	tmp->ts = time(NULL) + delay;
+	tmp->ts = ev_now() + (delay > 0 ? delay : 0);
 	list_add_tail(&tmp->list, &event_queue);
-	vinfo("Scheduled event: %p, time %li", tmp, tmp->ts);
+	vinfo("Scheduled event: %p, time %llu", tmp, (unsigned long long)tmp->ts);
 }
 
 void ev_remove(struct diskev *evt)
@@ -37,16 +45,25 @@ void ev_remove(struct diskev *evt)
 	free(evt);
 }
 
+void ev_flush(void)
+{
+	struct diskev *tmp, *next;
+
+	list_for_each_entry_safe(tmp, next, &event_queue, list)
+		ev_remove(tmp);
+}
+
 struct diskev *ev_next(void)
 {
-	time_t ts;
+	uint64_t ts;
 	struct diskev *tmp;
 	struct diskev *evt = NULL;
 
-	ts = time(NULL);
+	ts = ev_now();
 
 	list_for_each_entry(tmp, &event_queue, list) {
-		vdebug("Checking event %p, time %li/%li", tmp, tmp->ts, ts);
+		vdebug("Checking event %p, time %llu/%llu", tmp,
+		       (unsigned long long)tmp->ts, (unsigned long long)ts);
 		evt = tmp;
 		if (tmp->ts <= ts)
 			break;
@@ -54,11 +71,11 @@ struct diskev *ev_next(void)
 	}
 
 	if (!evt) {
-		vdebug("No scheduled events, time %li", ts);
+		vdebug("No scheduled events, time %llu", (unsigned long long)ts);
 		return NULL;
 	}
 
-	vinfo("Popping event: %p, time %li", evt, ts);
+	vinfo("Popping event: %p, time %llu", evt, (unsigned long long)ts);
 	list_del(&evt->list);
 	return evt;
 }
@@ -68,14 +85,17 @@ struct diskev *ev_find(struct diskev *evt)
 	struct diskev *tmp;
 
 	list_for_each_entry(tmp, &event_queue, list) {
-		if (evt->partuuid && tmp->partuuid) {
-			if (!strcmp(evt->partuuid, tmp->partuuid))
+		if (evt->partuuid_id.kind && tmp->partuuid_id.kind) {
+			if (id_equal(&evt->partuuid_id, evt->partuuid,
+				     &tmp->partuuid_id, tmp->partuuid))
 				return tmp;
-		} else if (evt->fsuuid && tmp->fsuuid) {
-			if (!strcmp(evt->fsuuid, tmp->fsuuid))
+		} else if (evt->fsuuid_id.kind && tmp->fsuuid_id.kind) {
+			if (id_equal(&evt->fsuuid_id, evt->fsuuid,
+				     &tmp->fsuuid_id, tmp->fsuuid))
 				return tmp;
-		} else if (evt->serial && tmp->serial) {
-			if (!strcmp(evt->serial, tmp->serial))
+		} else if (evt->serial_id.kind && tmp->serial_id.kind) {
+			if (id_equal(&evt->serial_id, evt->serial,
+				     &tmp->serial_id, tmp->serial))
 				return tmp;
 		} else if (evt->label && tmp->label) {
 			if (!strcmp(evt->label, tmp->label))
@@ -86,6 +106,162 @@ struct diskev *ev_find(struct diskev *evt)
 	return NULL;
 }
 
+/*
+ * Whole disk sysfs path, partitions sit right below their disk
+ * ("/block/sdb/sdb1"). Local events carry no device type, then
+ * partition is told by its number or by name of its parent.
+ */
+static int ev_disk_path(struct diskev *evt, size_t *len)
+{
+	const char *end, *up;
+
+	if (!evt->devpath)
+		return 0;
+
+	*len = strlen(evt->devpath);
+	end = strrchr(evt->devpath, '/');
+	if (!end || end == evt->devpath)
+		return 1;
+
+	for (up = end - 1; up > evt->devpath && *up != '/'; up--)
+		;
+	up++;
+
+	if ((evt->type && !strcmp(evt->type, "partition")) || evt->partnum ||
+	    (end > up && !strncmp(end + 1, up, end - up)))
+		*len = end - evt->devpath;
+
+	return 1;
+}
+
+/* Queued event of the same action on the same whole disk */
+struct diskev *ev_find_disk(struct diskev *evt)
+{
+	struct diskev *tmp;
+	size_t len, tlen;
+
+	if (!ev_disk_path(evt, &len))
+		return NULL;
+
+	list_for_each_entry(tmp, &event_queue, list) {
+		if (strcmp(evt->action, tmp->action) || !ev_disk_path(tmp, &tlen))
+			continue;
+		if (len == tlen && !strncmp(evt->devpath, tmp->devpath, len))
+			return tmp;
+	}
+
+	return NULL;
+}
+
+/*
+ * Milliseconds until next queued event becomes due, -1 if none.
+ * Events past due wait for operations in progress, not for time.
+ */
+int ev_due(void)
+{
+	struct diskev *tmp;
+	uint64_t now = ev_now(), due = UINT64_MAX;
+
+	list_for_each_entry(tmp, &event_queue, list) {
+		if (tmp->ts > now && tmp->ts < due)
+			due = tmp->ts;
+	}
+
+	if (due == UINT64_MAX)
+		return -1;
+
+	return due - now;
+}
+
+void ev_walk(ev_walk_cb cb, void *arg)
+{
+	struct diskev *tmp;
+
+	list_for_each_entry(tmp, &event_queue, list)
+		cb(tmp, arg);
+}
+
+static void ev_set(char **field, const char *val)
+{
+	if (*field)
+		free(*field);
+	*field = strdup(val);
+}
+
+int ev_update(struct diskev *evt, char *line)
+{
+	char *pos;
+
+	vdebug("Processing ENV line: '%s'", line);
+
+	pos = strchr(line, '=');
+	if (!pos) {
+		vwarn("Anomalous EVN parameter: '%s'", line);
+		return -1;
+	}
+	*pos = '\0';
+	pos++;
+
+	if (!strcmp(line, "ACTION")) {
+		ev_set(&evt->action, pos);
+	} else if (!strcmp(line, "SUBSYSTEM")) {
+		ev_set(&evt->subsys, pos);
+	} else if (!strcmp(line, "DEVTYPE")) {
+		ev_set(&evt->type, pos);
+	} else if (!strcmp(line, "DEVNAME")) {
+		if (evt->device)
+			free(evt->device);
+		if (strncmp(pos, "/dev", 4))
+			evt->device = strfdup("/dev/%s", pos);
+		else
+			evt->device = strdup(pos);
+	} else if (!strcmp(line, "ID_FS_TYPE")) {
+		ev_set(&evt->filesys, pos);
+	} else if (!strcmp(line, "ID_SERIAL_SHORT")) {
+		ev_set(&evt->serial, pos);
+	} else if (!strcmp(line, "ID_FS_LABEL")) {
+		ev_set(&evt->label, pos);
+	} else if (!strcmp(line, "ID_FS_UUID")) {
+		ev_set(&evt->fsuuid, pos);
+	} else if (!strcmp(line, "ID_PART_ENTRY_UUID")) {
+		ev_set(&evt->partuuid, pos);
+	} else if (!strcmp(line, "ID_FS_VERSION")) {
+		ev_set(&evt->fsversion, pos);
+	} else if (!strcmp(line, "ID_PART_ENTRY_NUMBER")) {
+		ev_set(&evt->partnum, pos);
+	} else if (!strcmp(line, "ID_PART_ENTRY_TYPE")) {
+		ev_set(&evt->parttype, pos);
+	} else if (!strcmp(line, "ID_PART_ENTRY_NAME")) {
+		ev_set(&evt->partname, pos);
+	} else if (!strcmp(line, "ID_PART_ENTRY_DISK")) {
+		ev_set(&evt->partdisk, pos);
+	} else if (!strcmp(line, "ID_PART_ENTRY_SCHEME")) {
+		ev_set(&evt->partscheme, pos);
+	} else if (!strcmp(line, "DEVPATH")) {
+		ev_set(&evt->devpath, pos);
+	} else if (!strcmp(line, "MAJOR")) {
+		evt->major = strtoul(pos, NULL, 10);
+	} else if (!strcmp(line, "MINOR")) {
+		evt->minor = strtoul(pos, NULL, 10);
+	} else if (!strcmp(line, "DISKSEQ")) {
+		evt->diskseq = strtoull(pos, NULL, 10);
+	} else if (!strcmp(line, "SEQNUM")) {
+		evt->seqnum = strtoull(pos, NULL, 10);
+	} else if (!strcmp(line, "DISK_MEDIA_CHANGE")) {
+		evt->media_change = !strcmp(pos, "1");
+	} else if (!strcmp(line, "USEC_INITIALIZED")) {
+		/* Only udev processed events carry
+		 * initialization time stamp. */
+		evt->probed = 1;
+	} else {
+		return 1;
+	}
+
+	vinfo("Included ENV param: '%s' = '%s'", line, pos);
+
+	return 0;
+}
+
 void ev_free(struct diskev *evt)
 {
 	if (evt->action)
@@ -106,13 +282,29 @@ void ev_free(struct diskev *evt)
 		free(evt->fsuuid);
 	if (evt->partuuid)
 		free(evt->partuuid);
+	if (evt->fsversion)
+		free(evt->fsversion);
+	if (evt->partnum)
+		free(evt->partnum);
+	if (evt->parttype)
+		free(evt->parttype);
+	if (evt->partname)
+		free(evt->partname);
+	if (evt->partdisk)
+		free(evt->partdisk);
+	if (evt->partscheme)
+		free(evt->partscheme);
+	if (evt->devpath)
+		free(evt->devpath);
 }
 
 int ev_check(struct diskev *evt)
 {
 	if (!evt->subsys || strcmp(evt->subsys, "block"))
 		return 1;
-	if (!evt->type || strcmp(evt->type, "partition"))
+	/* Whole disk matters only when its media is pulled */
+	if (!evt->type || (strcmp(evt->type, "partition") &&
+	    (strcmp(evt->type, "disk") || !evt->media_change)))
 		return 1;
 
 	return 0;
@@ -137,30 +329,41 @@ int ev_validate(struct diskev *evt)
 
 int ev_sanitize(struct diskev *evt)
 {
-	const char *val;
+	char *str;
 #ifdef WITH_LIBBLKID
+	const char *val;
 	blkid_probe pr;
 #endif
 
 	if (!evt->device)
 		return -1;
 
-	if (evt->fsuuid && evt->partuuid && evt->filesys)
+	/* Udev has already probed device, missing
+	 * properties are simply not present. */
+	if (evt->probed) {
+		vdebug("Trusted udev properties, device %s", evt->device);
+		ev_identify(evt);
+		return 0;
+	}
+
+	if (evt->fsuuid && evt->partuuid && evt->filesys) {
+		ev_identify(evt);
 		return 0;
+	}
 
 	if (!evt->fsuuid) {
-		val = get_disk_uuid(evt->device);
-		if (val) {
-			evt->fsuuid = strdup(val);
+		str = get_disk_uuid(evt->device);
+		if (str) {
+			evt->fsuuid = str;
 			vdebug("Updated FS UUID %s, device %s", evt->fsuuid, evt->device);
 		} else {
 			vwarn("Failed to update by-FS UUID, device %s", evt->device);
 		}
 	}
 	if (!evt->partuuid) {
-		val = get_disk_partuuid(evt->device);
-		if (val) {
-			evt->partuuid = strdup(val);
+		str = get_disk_partuuid(evt->device);
+		if (str) {
+			evt->partuuid = str;
 			vdebug("Updated PART UUID %s, device %s", evt->partuuid, evt->device);
 		} else {
 			vwarn("Failed to update by-PART UUID, device %s", evt->device);
@@ -168,8 +371,10 @@ int ev_sanitize(struct diskev *evt)
 	}
 
 #ifdef WITH_LIBBLKID
-	if (evt->fsuuid && evt->partuuid && evt->filesys)
+	if (evt->fsuuid && evt->partuuid && evt->filesys) {
+		ev_identify(evt);
 		return 0;
+	}
 
 	pr = blkid_new_probe_from_filename(evt->device);
 	if (!pr)
@@ -212,12 +417,64 @@ int ev_sanitize(struct diskev *evt)
 
 	blkid_free_probe(pr);
 #endif
+	ev_identify(evt);
 	return 0;
 }
 
+static void ev_identify_one(char **str, struct diskid *id,
+			    char *(*canon)(const char *, struct diskid *))
+{
+	char *tmp;
+
+	if (!*str || id->kind)
+		return;
+
+	tmp = canon(*str, id);
+	free(*str);
+	*str = tmp;
+}
+
+void ev_identify(struct diskev *evt)
+{
+	ev_identify_one(&evt->serial, &evt->serial_id, id_canon_serial);
+	ev_identify_one(&evt->fsuuid, &evt->fsuuid_id, id_canon_uuid);
+	ev_identify_one(&evt->partuuid, &evt->partuuid_id, id_canon_uuid);
+}
+
+void ev_locate(struct diskev *evt)
+{
+	struct stat st;
+
+	if (!evt->major && evt->device &&
+	    !stat(evt->device, &st) && S_ISBLK(st.st_mode)) {
+		evt->major = major(st.st_rdev);
+		evt->minor = minor(st.st_rdev);
+		vdebug("Updated device number %u:%u, device %s",
+		       evt->major, evt->minor, evt->device);
+	}
+
+	if (!evt->diskseq && evt->major) {
+		evt->diskseq = get_disk_seq(evt->major, evt->minor);
+		if (evt->diskseq)
+			vdebug("Updated disk sequence %llu, device %s",
+			       evt->diskseq, evt->device);
+	}
+}
+
 void ev_dump(FILE *fp, struct diskev *evt)
 {
-	fprintf(fp, "# Disk event: %s\n", evt->action);
+	fprintf(fp, "# Disk event: %s", evt->action);
+	if (evt->seqnum)
+		fprintf(fp, ", seq %llu", evt->seqnum);
+	if (evt->major)
+		fprintf(fp, ", dev %u:%u", evt->major, evt->minor);
+	if (evt->diskseq)
+		fprintf(fp, ", diskseq %llu", evt->diskseq);
+	if (evt->devpath)
+		fprintf(fp, ", path %s", evt->devpath);
+	if (evt->probed)
+		fprintf(fp, ", probed");
+	fprintf(fp, "\n");
 
 	if (evt->device)
 		fprintf(fp, "DEV=%s\t\t", evt->device);
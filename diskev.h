@@ -1,8 +1,10 @@
 #ifndef _DISKEV_H
 #define _DISKEV_H
 
-#include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include "list.h"
+#include "diskid.h"
 
 struct diskev {
 	char *subsys;
@@ -14,18 +16,54 @@ struct diskev {
 	char *label;
 	char *fsuuid;
 	char *partuuid;
-	time_t ts;
+	char *fsversion;
+	char *partnum;
+	char *parttype;
+	char *partname;
+	char *partdisk;
+	char *partscheme;
+	char *devpath;
+	unsigned int major;
+	unsigned int minor;
+	unsigned long long diskseq;
+	unsigned long long seqnum;
+	/* Canonical binary identities */
+	struct diskid serial_id;
+	struct diskid fsuuid_id;
+	struct diskid partuuid_id;
+	/* Properties were resolved by udev,
+	 * no need to probe device again. */
+	int probed;
+	/* Nested mounts were asked to unmount */
+	int cascaded;
+	/* Kernel reported media change */
+	int media_change;
+	/* Device already left the system */
+	int gone;
+	/* Receive time, monotonic us */
+	uint64_t recv;
+	/* Due time, monotonic ms */
+	uint64_t ts;
 	struct list_head list;
 };
 
+typedef void (*ev_walk_cb)(struct diskev *evt, void *arg);
+
 void ev_insert(struct diskev *evt, off_t delay);
 void ev_remove(struct diskev *evt);
+void ev_flush(void);
 struct diskev *ev_next(void);
 struct diskev *ev_find(struct diskev *evt);
+struct diskev *ev_find_disk(struct diskev *evt);
+int ev_due(void);
+void ev_walk(ev_walk_cb cb, void *arg);
 void ev_free(struct diskev *evt);
+int ev_update(struct diskev *evt, char *line);
 int ev_check(struct diskev *evt);
 int ev_validate(struct diskev *evt);
 int ev_sanitize(struct diskev *evt);
+void ev_identify(struct diskev *evt);
+void ev_locate(struct diskev *evt);
 void ev_dump(FILE *fp, struct diskev *evt);
 
 #endif // _DISKEV_H
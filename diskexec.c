@@ -0,0 +1,240 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "diskexec.h"
+
+/* Time from SIGTERM to SIGKILL */
+#define EXEC_KILL_GRACE 2000
+/* Poll slice when pidfd is not supported */
+#define EXEC_POLL_SLICE 50
+
+extern char **environ;
+
+/* Deadline cap of all helpers, monotonic us */
+static uint64_t exec_limit = (uint64_t)-1;
+/* Stays readable once cap is set, wakes waiting helpers */
+static int exec_efd = -1;
+static pthread_once_t exec_once = PTHREAD_ONCE_INIT;
+
+static void exec_setup(void)
+{
+	exec_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (exec_efd < 0)
+		vwarn("Cannot create helper eventfd: %s", strerror(errno));
+}
+
+/*
+ * Caps deadline of running and later helpers, i.e. on shutdown.
+ * Helpers past it are terminated as if they timed out.
+ */
+void exec_set_deadline(uint64_t deadline)
+{
+	uint64_t one = 1;
+
+	pthread_once(&exec_once, exec_setup);
+	__atomic_store_n(&exec_limit, deadline, __ATOMIC_RELEASE);
+	if (exec_efd >= 0 && write(exec_efd, &one, sizeof(one)) < 0)
+		vwarn("Failed to wake helpers");
+}
+
+static int exec_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void exec_kill(pid_t pid, int pidfd, int sig)
+{
+#ifdef SYS_pidfd_send_signal
+	if (pidfd >= 0 && !syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0))
+		return;
+#endif
+	kill(pid, sig);
+}
+
+static void exec_read(int fd, struct exec_res *res)
+{
+	char buf[256];
+	ssize_t len;
+	size_t room;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		room = sizeof(res->err) - 1 - res->errlen;
+		if ((size_t)len > room)
+			len = room;
+		memcpy(res->err + res->errlen, buf, len);
+		res->errlen += len;
+	}
+}
+
+static int exec_spawn(char *const argv[], int errfd, pid_t *pid)
+{
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	int ret;
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_adddup2(&fa, errfd, 2);
+
+	/* Do not leak daemon signal state into helper */
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+				 POSIX_SPAWN_SETSIGDEF);
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	sigfillset(&mask);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+
+	ret = posix_spawnp(pid, argv[0], &fa, &attr, argv, environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	return ret;
+}
+
+/*
+ * Runs helper without shell and waits for it on pidfd
+ * while collecting stderr. On deadline helper gets
+ * SIGTERM, then SIGKILL after grace period. Returns 0
+ * if helper exited with 0, otherwise -1 with errno set.
+ */
+int exec_run(char *const argv[], unsigned int timeout_ms, struct exec_res *res)
+{
+	struct pollfd pfd[3];
+	uint64_t now, deadline, limit;
+	int pipefd[2];
+	int pidfd, sig = SIGTERM;
+	int ret, tmo, reaped = 0;
+	pid_t pid;
+
+	memset(res, 0, sizeof(*res));
+	pthread_once(&exec_once, exec_setup);
+
+	if (pipe2(pipefd, O_CLOEXEC)) {
+		verror("Failed to create pipe: %s", strerror(errno));
+		return -1;
+	}
+
+	ret = exec_spawn(argv, pipefd[1], &pid);
+	close(pipefd[1]);
+	if (ret) {
+		verror("Failed to spawn '%s': %s", argv[0], strerror(ret));
+		close(pipefd[0]);
+		errno = ret;
+		return -1;
+	}
+	set_nio(pipefd[0]);
+
+	pidfd = exec_pidfd(pid);
+	if (pidfd < 0)
+		vdebug("No pidfd for '%s' (%s), polling", argv[0], strerror(errno));
+
+	pfd[0].fd = pidfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = pipefd[0];
+	pfd[1].events = POLLIN;
+	pfd[2].fd = exec_efd;
+	pfd[2].events = POLLIN;
+
+	deadline = mono_usec() + timeout_ms * 1000ULL;
+	for (;;) {
+		if (pidfd < 0 && waitpid(pid, &res->status, WNOHANG) == pid) {
+			reaped = 1;
+			break;
+		}
+
+		/* Cap applies once, termination then runs its course */
+		limit = __atomic_load_n(&exec_limit, __ATOMIC_ACQUIRE);
+		if (pfd[2].fd >= 0 && limit != (uint64_t)-1) {
+			pfd[2].fd = -1;
+			if (sig && limit < deadline)
+				deadline = limit;
+		}
+
+		now = mono_usec();
+		if (now >= deadline) {
+			vwarn("Helper '%s' [%d] timed out, sending %s",
+			      argv[0], pid, sig == SIGTERM ? "SIGTERM" : "SIGKILL");
+			exec_kill(pid, pidfd, sig);
+			res->timeout = 1;
+			if (sig == SIGTERM) {
+				deadline = now + EXEC_KILL_GRACE * 1000ULL;
+				sig = SIGKILL;
+			} else {
+				sig = 0;
+				/* Wait for reap */
+				deadline = (uint64_t)-1;
+			}
+			continue;
+		}
+
+		if (deadline == (uint64_t)-1)
+			tmo = -1;
+		else
+			tmo = (deadline - now + 999) / 1000;
+		if (pidfd < 0 && (tmo < 0 || tmo > EXEC_POLL_SLICE))
+			tmo = EXEC_POLL_SLICE;
+
+		ret = poll(pfd, 3, tmo);
+		if (ret < 0 && errno != EINTR) {
+			verror("Failed to poll helper '%s': %s", argv[0], strerror(errno));
+			exec_kill(pid, pidfd, SIGKILL);
+			break;
+		}
+		if (ret <= 0)
+			continue;
+
+		if (pfd[1].revents) {
+			exec_read(pipefd[0], res);
+			/* Closed by helper, stop polling */
+			if (pfd[1].revents & (POLLHUP | POLLERR))
+				pfd[1].fd = -1;
+		}
+		if (pidfd >= 0 && pfd[0].revents)
+			break;
+	}
+
+	if (!reaped) {
+		while (waitpid(pid, &res->status, 0) < 0 && errno == EINTR)
+			;
+	}
+	/* Helper may exit before its output is read */
+	exec_read(pipefd[0], res);
+	res->err[res->errlen] = '\0';
+	/* Drop trailing newline for logging */
+	while (res->errlen && res->err[res->errlen - 1] == '\n')
+		res->err[--res->errlen] = '\0';
+
+	if (pidfd >= 0)
+		close(pidfd);
+	close(pipefd[0]);
+
+	if (res->timeout) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	if (!WIFEXITED(res->status) || WEXITSTATUS(res->status)) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
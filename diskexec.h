@@ -0,0 +1,23 @@
+#ifndef _DISKEXEC_H
+#define _DISKEXEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EXEC_ERR_MAX 512
+
+/*
+ * Helper outcome: wait status, deadline hit
+ * flag and captured (truncated) stderr.
+ */
+struct exec_res {
+	int status;
+	int timeout;
+	size_t errlen;
+	char err[EXEC_ERR_MAX];
+};
+
+int exec_run(char *const argv[], unsigned int timeout_ms, struct exec_res *res);
+void exec_set_deadline(uint64_t deadline);
+
+#endif // _DISKEXEC_H
@@ -0,0 +1,196 @@
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "diskid.h"
+
+#define ID_MAX_NIBBLES 32
+#define ID_MAX_RAW 16
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static void id_pack_string(struct diskid *id, const char *str)
+{
+	uint64_t h1 = FNV_OFFSET;
+	uint64_t h2 = FNV_OFFSET ^ 0x5bd1e9955bd1e995ULL;
+	size_t len = strlen(str);
+	size_t i;
+
+	memset(id, 0, sizeof(*id));
+
+	if (len <= ID_MAX_RAW) {
+		id->kind = DISKID_RAW;
+		id->len = len;
+		for (i = 0; i < len; i++) {
+			if (i < 8)
+				id->hi |= (uint64_t)(unsigned char)str[i] << (56 - i * 8);
+			else
+				id->lo |= (uint64_t)(unsigned char)str[i] << (56 - (i - 8) * 8);
+		}
+		return;
+	}
+
+	/* Two independent hashes, string is
+	 * compared only when both collide. */
+	for (i = 0; i < len; i++) {
+		h1 = (h1 ^ (unsigned char)str[i]) * FNV_PRIME;
+		h2 = (h2 ^ (unsigned char)str[len - i - 1]) * FNV_PRIME;
+	}
+
+	id->kind = DISKID_HASH;
+	id->len = len > 255 ? 255 : len;
+	id->hi = h1;
+	id->lo = h2;
+}
+
+static int id_pack_hex(struct diskid *id, const char *str)
+{
+	int nibbles = 0;
+	int val;
+
+	memset(id, 0, sizeof(*id));
+
+	for (; *str; str++) {
+		if (*str == '-')
+			continue;
+		if (!isxdigit((unsigned char)*str))
+			return 1;
+		if (nibbles == ID_MAX_NIBBLES)
+			return 1;
+
+		val = isdigit((unsigned char)*str) ? *str - '0' :
+			tolower((unsigned char)*str) - 'a' + 10;
+		/* Shift whole 128bit value by nibble */
+		id->hi = (id->hi << 4) | (id->lo >> 60);
+		id->lo = (id->lo << 4) | val;
+		nibbles++;
+	}
+
+	if (!nibbles)
+		return 1;
+
+	id->kind = DISKID_HEX;
+	id->len = nibbles;
+	return 0;
+}
+
+static void id_format_hex(const struct diskid *id, char *buf)
+{
+	static const char digits[] = "0123456789abcdef";
+	/* Dash positions for well known layouts */
+	static const int uuid_dash[] = { 8, 12, 16, 20, 0 };
+	static const int vfat_dash[] = { 4, 0 };
+	static const int mbr_dash[] = { 8, 0 };
+	const int *dash = NULL;
+	uint64_t word;
+	int i, pos;
+
+	if (id->len == 32)
+		dash = uuid_dash;
+	else if (id->len == 8)
+		dash = vfat_dash;
+	else if (id->len == 10)
+		dash = mbr_dash;
+
+	for (i = 0; i < id->len; i++) {
+		if (dash && *dash && *dash == i) {
+			*buf++ = '-';
+			dash++;
+		}
+		pos = id->len - i - 1;
+		word = pos < 16 ? id->lo : id->hi;
+		*buf++ = digits[(word >> ((pos % 16) * 4)) & 0xf];
+	}
+	*buf = '\0';
+}
+
+char *id_canon_uuid(const char *str, struct diskid *id)
+{
+	char buf[ID_MAX_NIBBLES + 8];
+	char *res;
+	char *pos;
+
+	if (!id_pack_hex(id, str)) {
+		id_format_hex(id, buf);
+		res = strdup(buf);
+		if (!res)
+			die("strdup() failed");
+		return res;
+	}
+
+	/* Not a hex identifier, i.e. LVM like
+	 * UUID, compare it case insensitive. */
+	res = strdup(str);
+	if (!res)
+		die("strdup() failed");
+	for (pos = res; *pos; pos++)
+		*pos = tolower((unsigned char)*pos);
+
+	id_pack_string(id, res);
+	return res;
+}
+
+char *id_canon_serial(const char *str, struct diskid *id)
+{
+	char *res;
+	char *pos;
+	int space = 0;
+
+	while (isspace((unsigned char)*str))
+		str++;
+
+	res = malloc(strlen(str) + 1);
+	if (!res)
+		die("malloc() failed");
+
+	/* Same as udev ID_SERIAL_SHORT: inner
+	 * whitespace runs become underscore. */
+	for (pos = res; *str; str++) {
+		if (isspace((unsigned char)*str)) {
+			space = 1;
+			continue;
+		}
+		if (space && pos != res)
+			*pos++ = '_';
+		space = 0;
+		*pos++ = toupper((unsigned char)*str);
+	}
+	*pos = '\0';
+
+	id_pack_string(id, res);
+	return res;
+}
+
+/*
+ * Compares binary identities, hashed ones are confirmed on
+ * canonical strings they were made of, when both are given.
+ */
+int id_equal(const struct diskid *a, const char *sa,
+	     const struct diskid *b, const char *sb)
+{
+	if (a->kind == DISKID_NONE || b->kind == DISKID_NONE)
+		return 0;
+
+	if (a->kind != b->kind || a->len != b->len ||
+	    a->hi != b->hi || a->lo != b->lo)
+		return 0;
+
+	if (a->kind == DISKID_HASH && sa && sb)
+		return !strcmp(sa, sb);
+
+	return 1;
+}
+
+uint32_t id_hash(const struct diskid *id)
+{
+	uint64_t h;
+
+	h = id->hi * FNV_PRIME ^ id->lo;
+	h ^= ((uint64_t)id->kind << 8) | id->len;
+	h *= FNV_PRIME;
+
+	return (uint32_t)(h ^ (h >> 32));
+}
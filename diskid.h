@@ -0,0 +1,28 @@
+#ifndef _DISKID_H
+#define _DISKID_H
+
+#include <stdint.h>
+
+#define DISKID_NONE 0
+/* Hex digits packed into words, 'len' in nibbles */
+#define DISKID_HEX 1
+/* Short string packed into words, 'len' in bytes */
+#define DISKID_RAW 2
+/* Long string hashed into words, 'len' in bytes (capped);
+ * equal hashes are confirmed on canonical strings */
+#define DISKID_HASH 3
+
+struct diskid {
+	uint64_t hi;
+	uint64_t lo;
+	uint8_t kind;
+	uint8_t len;
+};
+
+char *id_canon_uuid(const char *str, struct diskid *id);
+char *id_canon_serial(const char *str, struct diskid *id);
+int id_equal(const struct diskid *a, const char *sa,
+	     const struct diskid *b, const char *sb);
+uint32_t id_hash(const struct diskid *id);
+
+#endif // _DISKID_H
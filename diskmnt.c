@@ -0,0 +1,513 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#ifdef WITH_LIBMOUNT
+#include <libmount/libmount.h>
+#endif
+
+#include "util.h"
+#include "list.h"
+#include "diskexec.h"
+#include "diskmnt.h"
+
+/* Mount helper deadlines, ms */
+#define MOUNT_TIMEOUT 30000
+#define UMOUNT_TIMEOUT 15000
+/* Lazy detach does not flush, needs no long wait */
+#define DETACH_TIMEOUT 3000
+/* Large filesystems take long to check */
+#define FSCK_TIMEOUT 3600000
+
+/* New mount API (Linux 5.2+), not all libc headers carry it */
+#ifndef SYS_fsopen
+#define SYS_move_mount 429
+#define SYS_fsopen 430
+#define SYS_fsconfig 431
+#define SYS_fsmount 432
+#endif
+#define FSAPI_OPEN_CLOEXEC 0x1
+#define FSAPI_SET_FLAG 0
+#define FSAPI_SET_STRING 1
+#define FSAPI_CMD_CREATE 6
+#define FSAPI_MOUNT_CLOEXEC 0x1
+#define FSAPI_ATTR_RDONLY 0x01
+#define FSAPI_ATTR_NOSUID 0x02
+#define FSAPI_ATTR_NODEV 0x04
+#define FSAPI_ATTR_NOEXEC 0x08
+#define FSAPI_ATTR_NOATIME 0x10
+#define FSAPI_ATTR_STRICTATIME 0x20
+#define FSAPI_ATTR_NODIRATIME 0x80
+#define FSAPI_MOVE_EMPTY_PATH 0x4
+
+/*
+ * Superblock flags passed to fs context as flag parameters;
+ * MS_SILENT has none, fs context always logs to its fd.
+ */
+static const struct {
+	unsigned long flag;
+	const char *name;
+} fsapi_sb_flags[] = {
+	{ MS_RDONLY, "ro" },
+	{ MS_SYNCHRONOUS, "sync" },
+	{ MS_DIRSYNC, "dirsync" },
+	{ MS_LAZYTIME, "lazytime" },
+};
+
+/* New mount API use: -1 unprobed, 0 missing, 1 available */
+static int fsapi_state = -1;
+
+#if defined(WITH_LIBMOUNT)
+/*
+ * libmount context and cache are not thread safe,
+ * so each worker keeps its own pair and reuses it
+ * across mounts. Slots are released on shutdown.
+ */
+struct mnt_slot {
+	struct libmnt_context *cxt;
+	struct libmnt_cache *cache;
+	struct list_head list;
+};
+
+static struct list_head mnt_slots = LIST_HEAD_INIT(mnt_slots);
+static pthread_mutex_t mnt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t mnt_once = PTHREAD_ONCE_INIT;
+static __thread struct mnt_slot *mnt_slot;
+
+static void mnt_setup(void)
+{
+	mnt_init_debug(0);
+}
+
+static struct libmnt_context *mnt_context(struct mnt_slot *slot)
+{
+	if (slot->cxt)
+		return slot->cxt;
+
+	slot->cxt = mnt_new_context();
+	if (!slot->cxt) {
+		verror("Failed to allocate MNT context");
+		return NULL;
+	}
+
+	if (mnt_context_set_cache(slot->cxt, slot->cache))
+		verror("Failed to set MNT cache");
+	if (mnt_context_enable_verbose(slot->cxt, 1))
+		verror("Failed to set MNT verbose");
+
+	return slot->cxt;
+}
+
+static struct libmnt_context *mnt_acquire(void)
+{
+	struct mnt_slot *slot = mnt_slot;
+
+	if (slot)
+		return mnt_context(slot);
+
+	pthread_once(&mnt_once, mnt_setup);
+
+	slot = calloc(1, sizeof(*slot));
+	if (!slot)
+		die("malloc() failed");
+
+	slot->cache = mnt_new_cache();
+	if (!slot->cache)
+		verror("Failed to allocate MNT cache");
+
+	pthread_mutex_lock(&mnt_lock);
+	list_add_tail(&slot->list, &mnt_slots);
+	pthread_mutex_unlock(&mnt_lock);
+	mnt_slot = slot;
+
+	return mnt_context(slot);
+}
+
+/* Clears per mount state, keeps cache */
+static void mnt_release(struct libmnt_context *cxt)
+{
+	struct mnt_slot *slot = mnt_slot;
+
+	if (!mnt_reset_context(cxt))
+		return;
+
+	vwarn("Failed to reset MNT context, dropping");
+	mnt_free_context(cxt);
+	slot->cxt = NULL;
+}
+#endif
+
+/* In-kernel filesystems mounted without helper */
+static const char *mount_native[] = {
+	"ext4", "vfat", "exfat", "ntfs3", "xfs", "btrfs",
+};
+
+static int mount_is_native(const char *type)
+{
+	unsigned int i;
+
+	if (!type)
+		return 0;
+
+	for (i = 0; i < sizeof(mount_native) / sizeof(mount_native[0]); i++) {
+		if (!strcmp(type, mount_native[i]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Drains fs context log, lines are prefixed "e ", "w " or "i " */
+static void fsapi_log(int fd, const char *device, int failed)
+{
+	char buf[256];
+	ssize_t len;
+	int err = errno;
+
+	while ((len = read(fd, buf, sizeof(buf) - 1)) > 0) {
+		while (len && buf[len - 1] == '\n')
+			len--;
+		buf[len] = '\0';
+		if (failed)
+			verror("Mount '%s': %s", device, len > 2 ? buf + 2 : buf);
+		else
+			vwarn("Mount '%s': %s", device, len > 2 ? buf + 2 : buf);
+	}
+	errno = err;
+}
+
+static int fsapi_config(int fd, const char *data)
+{
+	char buf[PATH_MAX];
+	char *opt, *val, *ptr = buf;
+
+	snprintf(buf, sizeof(buf), "%s", data);
+	while ((opt = strsep(&ptr, ","))) {
+		if (!*opt)
+			continue;
+		val = strchr(opt, '=');
+		if (val)
+			*val++ = '\0';
+		if (syscall(SYS_fsconfig, fd, val ? FSAPI_SET_STRING : FSAPI_SET_FLAG,
+			    opt, val, 0) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Creates filesystem context with source and options set,
+ * superblock is not created yet. Returns context fd.
+ */
+static int fsapi_prepare(const char *device, const char *type,
+			 unsigned long flags, const char *data)
+{
+	unsigned int i;
+	int fd;
+
+	fd = syscall(SYS_fsopen, type, FSAPI_OPEN_CLOEXEC);
+	if (fd < 0) {
+		/* Seccomp filters deny unknown syscalls with EPERM */
+		if (errno == EPERM)
+			errno = ENOSYS;
+		return -1;
+	}
+
+	if (syscall(SYS_fsconfig, fd, FSAPI_SET_STRING, "source", device, 0) < 0)
+		goto fail;
+
+	for (i = 0; i < sizeof(fsapi_sb_flags) / sizeof(fsapi_sb_flags[0]); i++) {
+		if (!(flags & fsapi_sb_flags[i].flag))
+			continue;
+		if (syscall(SYS_fsconfig, fd, FSAPI_SET_FLAG,
+			    fsapi_sb_flags[i].name, NULL, 0) < 0)
+			goto fail;
+	}
+
+	if (data && fsapi_config(fd, data))
+		goto fail;
+
+	return fd;
+fail:
+	/* Rejected options are retried with mount(2) */
+	fsapi_log(fd, device, errno != EINVAL);
+	close(fd);
+	return -1;
+}
+
+/* Creates superblock, then attaches mount with all attributes at once */
+static int fsapi_attach(int fd, const char *device, const char *point,
+			unsigned long flags)
+{
+	unsigned int attr = 0;
+	int mfd, err;
+
+	if (flags & MS_RDONLY)
+		attr |= FSAPI_ATTR_RDONLY;
+	if (flags & MS_NOSUID)
+		attr |= FSAPI_ATTR_NOSUID;
+	if (flags & MS_NODEV)
+		attr |= FSAPI_ATTR_NODEV;
+	if (flags & MS_NOEXEC)
+		attr |= FSAPI_ATTR_NOEXEC;
+	if (flags & MS_NODIRATIME)
+		attr |= FSAPI_ATTR_NODIRATIME;
+	/* Relatime is default */
+	if (flags & MS_NOATIME)
+		attr |= FSAPI_ATTR_NOATIME;
+	else if (flags & MS_STRICTATIME)
+		attr |= FSAPI_ATTR_STRICTATIME;
+
+	if (syscall(SYS_fsconfig, fd, FSAPI_CMD_CREATE, NULL, NULL, 0) < 0) {
+		fsapi_log(fd, device, 1);
+		return -1;
+	}
+
+	mfd = syscall(SYS_fsmount, fd, FSAPI_MOUNT_CLOEXEC, attr);
+	if (mfd < 0) {
+		fsapi_log(fd, device, 1);
+		return -1;
+	}
+	fsapi_log(fd, device, 0);
+
+	if (syscall(SYS_move_mount, mfd, "", AT_FDCWD, point,
+		    FSAPI_MOVE_EMPTY_PATH) < 0) {
+		err = errno;
+		close(mfd);
+		errno = err;
+		return -1;
+	}
+
+	close(mfd);
+	return 0;
+}
+
+/*
+ * Returns -1 with ENOSYS when kernel lacks new mount API or it is
+ * denied by seccomp, 1 when fs context rejects options which
+ * mount(2) data may still take.
+ */
+static int mount_fsapi(const char *device, const char *point,
+		       const char *type, unsigned long flags, const char *data)
+{
+	int fd, ret, err;
+
+	fd = fsapi_prepare(device, type, flags, data);
+	if (fd < 0)
+		return errno == EINVAL ? 1 : -1;
+
+	ret = fsapi_attach(fd, device, point, flags);
+	err = errno;
+	close(fd);
+	errno = err;
+
+	return ret;
+}
+
+static int mount_try(const char *device, const char *point,
+		     const char *type, unsigned long flags, const char *data)
+{
+	int state = __atomic_load_n(&fsapi_state, __ATOMIC_RELAXED);
+	int ret;
+
+	if (state) {
+		ret = mount_fsapi(device, point, type, flags, data);
+		if (ret > 0) {
+			vinfo("Options of '%s' rejected by fs context, using mount(2)", device);
+			return mount(device, point, type, flags, data);
+		}
+		if (!ret || errno != ENOSYS) {
+			if (state < 0) {
+				vinfo("Using new mount API");
+				__atomic_store_n(&fsapi_state, 1, __ATOMIC_RELAXED);
+			}
+			return ret;
+		}
+		vinfo("New mount API is not available, using mount(2)");
+		__atomic_store_n(&fsapi_state, 0, __ATOMIC_RELAXED);
+	}
+
+	return mount(device, point, type, flags, data);
+}
+
+/* Direct mount, retries read-only if device is write protected */
+static int mount_direct(const char *device, const char *point,
+			const char *type, unsigned long flags, const char *data)
+{
+	if (!mount_try(device, point, type, flags, data))
+		return 0;
+
+	if ((errno != EACCES && errno != EROFS) || (flags & MS_RDONLY))
+		return -1;
+
+	vwarn("Device '%s' is write-protected, mounting read-only", device);
+	return mount_try(device, point, type, flags | MS_RDONLY, data);
+}
+
+#ifdef WITH_SHMOUNT
+static int run_helper(char *argv[], unsigned int timeout)
+{
+	struct exec_res res;
+	int ret, err;
+
+	ret = exec_run(argv, timeout, &res);
+	if (ret && res.errlen) {
+		err = errno;
+		verror("Helper '%s' failed: %s", argv[0], res.err);
+		errno = err;
+	}
+	return ret;
+}
+#endif
+
+/*
+ * Mounts through mount(2) when filesystem is in-kernel and
+ * options need no helper, otherwise through libmount or
+ * mount helper. Flags are defaults, rule options override.
+ */
+int perform_mount(const char *device, const char *type,
+		  unsigned long flags, const struct diskmatch *match)
+{
+	const char *point = match->point;
+	const char *opts = match->opts;
+#if defined(WITH_LIBMOUNT)
+	struct libmnt_context *cxt;
+	int ret = 1;
+#endif
+
+	if (mount_is_native(type) && !match->helper) {
+		flags = (flags & ~match->flags_clear) | match->flags_set;
+		vdebug("Mounting '%s' directly, flags 0x%lx, data '%s'",
+		       device, flags, match->data ? match->data : "");
+		return mount_direct(device, point, type, flags, match->data);
+	}
+
+#if defined(WITH_LIBMOUNT)
+	cxt = mnt_acquire();
+	if (!cxt)
+		return -1;
+
+	if (mnt_context_append_options(cxt, opts ? opts : "rw")) {
+		verror("Failed to set MNT 'rw' options '%s'", opts);
+		goto out;
+	}
+
+	if (mnt_context_set_fstype(cxt, type)) {
+		verror("Failed to set MNT type '%s'", type);
+		goto out;
+	}
+
+	if (mnt_context_set_source(cxt, device)) {
+		verror("Failed to set MNT source '%s'", device);
+		goto out;
+	}
+
+	if (mnt_context_set_target(cxt, point)) {
+		verror("Failed to set MNT target '%s'", point);
+		goto out;
+	}
+
+	if (mnt_context_set_mflags(cxt, flags)) {
+		verror("Failed to set MNT flags '%lu'", flags);
+		goto out;
+	}
+
+	if (mnt_context_is_restricted(cxt)) {
+		vwarn("Mounting is restricted");
+	}
+
+	if (mnt_context_mount(cxt)) {
+		goto out;
+	}
+
+	ret = 0;
+out:
+	mnt_release(cxt);
+	return ret;
+#elif defined(WITH_SHMOUNT)
+	char *argv[] = { "mount", "-t", (char *)type, "-o",
+		(char *)(opts ? opts : "rw"), (char *)device, (char *)point, NULL };
+
+	return run_helper(argv, MOUNT_TIMEOUT);
+#else
+	if (match->helper)
+		vwarn("Options '%s' need mount helper, trying mount(2)", opts);
+	flags = (flags & ~match->flags_clear) | match->flags_set;
+	return mount_direct(device, point, type, flags, match->data);
+#endif
+}
+
+/*
+ * Unmounts per detach policy: lazy detach right away, on
+ * EBUSY only, or never. Lazily detached mount goes away
+ * from namespace at once, filesystem once it is unused.
+ */
+int perform_umount(const char *device, const char *point, int detach)
+{
+#if defined(WITH_SHMOUNT)
+	char *argv[] = { "umount", (char *)point, NULL };
+	char *lazy[] = { "umount", "-l", (char *)point, NULL };
+
+	if (detach == CONF_DETACH_ALWAYS)
+		return run_helper(lazy, DETACH_TIMEOUT);
+	if (!run_helper(argv, UMOUNT_TIMEOUT))
+		return 0;
+	if (detach == CONF_DETACH_NEVER)
+		return -1;
+	vwarn("Unmount of '%s' failed, detaching lazily", point);
+	return run_helper(lazy, DETACH_TIMEOUT);
+#else
+	if (detach == CONF_DETACH_ALWAYS)
+		return umount2(point, MNT_DETACH);
+	if (!umount(point))
+		return 0;
+	if (errno != EBUSY || detach == CONF_DETACH_NEVER)
+		return -1;
+	vwarn("Mount '%s' is busy, detaching lazily", point);
+	return umount2(point, MNT_DETACH);
+#endif
+}
+
+/*
+ * Checks filesystem with fsck in preen mode. Corrected errors
+ * (exit status 1 and 2) count as success. Helper status and
+ * output are left in res for reporting.
+ */
+int perform_check(const char *device, const char *type, struct exec_res *res)
+{
+	char *argv[] = { "fsck", "-a", "-T", "-t", (char *)type, (char *)device, NULL };
+
+	if (!exec_run(argv, FSCK_TIMEOUT, res))
+		return 0;
+	/* Spawn failure leaves no status */
+	if (errno == EIO && WIFEXITED(res->status) && WEXITSTATUS(res->status) <= 2)
+		return 0;
+
+	return -1;
+}
+
+/* Frees per worker state, workers must be stopped */
+void mount_release(void)
+{
+#if defined(WITH_LIBMOUNT)
+	struct mnt_slot *slot, *tmp;
+
+	list_for_each_entry_safe(slot, tmp, &mnt_slots, list) {
+		list_del(&slot->list);
+		if (slot->cxt)
+			mnt_free_context(slot->cxt);
+		if (slot->cache)
+			mnt_unref_cache(slot->cache);
+		free(slot);
+	}
+	mnt_slot = NULL;
+#endif
+}
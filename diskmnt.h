@@ -0,0 +1,13 @@
+#ifndef _DISKMNT_H
+#define _DISKMNT_H
+
+#include "diskconf.h"
+#include "diskexec.h"
+
+int perform_mount(const char *device, const char *type,
+		  unsigned long flags, const struct diskmatch *match);
+int perform_umount(const char *device, const char *point, int detach);
+int perform_check(const char *device, const char *type, struct exec_res *res);
+void mount_release(void);
+
+#endif // _DISKMNT_H
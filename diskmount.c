@@ -6,6 +6,12 @@
 #include "util.h"
 #include "diskev.h"
 #include "evsock.h"
+#include "diskstat.h"
+
+static int is_key(const char *line, const char *pos, const char *key)
+{
+	return strlen(key) == pos - line && !strncmp(line, key, pos - line);
+}
 
 static void update(struct diskev *evt, char *line)
 {
@@ -17,24 +23,52 @@ static void update(struct diskev *evt, char *line)
 		return;
 	val = pos + 1;
 
-	if (!strncmp(line, "ACTION", pos - line)) {
+	if (is_key(line, pos, "ACTION")) {
 		evt->action = val;
-	} else if (!strncmp(line, "SUBSYSTEM", pos - line)) {
+	} else if (is_key(line, pos, "SUBSYSTEM")) {
 		evt->subsys = val;
-	} else if (!strncmp(line, "DEVTYPE", pos - line)) {
+	} else if (is_key(line, pos, "DEVTYPE")) {
 		evt->type = val;
-	} else if (!strncmp(line, "DEVNAME", pos - line)) {
+	} else if (is_key(line, pos, "DEVNAME")) {
 		evt->device = val;
-	} else if (!strncmp(line, "ID_FS_TYPE", pos - line)) {
+	} else if (is_key(line, pos, "ID_FS_TYPE")) {
 		evt->filesys = val;
-	} else if (!strncmp(line, "ID_SERIAL_SHORT", pos - line)) {
+	} else if (is_key(line, pos, "ID_SERIAL_SHORT")) {
 		evt->serial = val;
-	} else if (!strncmp(line, "ID_FS_LABEL", pos - line)) {
+	} else if (is_key(line, pos, "ID_FS_LABEL")) {
 		evt->label = val;
-	} else if (!strncmp(line, "ID_FS_UUID", pos - line)) {
+	} else if (is_key(line, pos, "ID_FS_UUID")) {
 		evt->fsuuid = val;
-	} else if (!strncmp(line, "ID_PART_ENTRY_UUID", pos - line)) {
+	} else if (is_key(line, pos, "ID_PART_ENTRY_UUID")) {
 		evt->partuuid = val;
+	} else if (is_key(line, pos, "ID_FS_VERSION")) {
+		evt->fsversion = val;
+	} else if (is_key(line, pos, "ID_PART_ENTRY_NUMBER")) {
+		evt->partnum = val;
+	} else if (is_key(line, pos, "ID_PART_ENTRY_TYPE")) {
+		evt->parttype = val;
+	} else if (is_key(line, pos, "ID_PART_ENTRY_NAME")) {
+		evt->partname = val;
+	} else if (is_key(line, pos, "ID_PART_ENTRY_DISK")) {
+		evt->partdisk = val;
+	} else if (is_key(line, pos, "ID_PART_ENTRY_SCHEME")) {
+		evt->partscheme = val;
+	} else if (is_key(line, pos, "DEVPATH")) {
+		evt->devpath = val;
+	} else if (is_key(line, pos, "MAJOR")) {
+		evt->major = strtoul(val, NULL, 10);
+	} else if (is_key(line, pos, "MINOR")) {
+		evt->minor = strtoul(val, NULL, 10);
+	} else if (is_key(line, pos, "DISKSEQ")) {
+		evt->diskseq = strtoull(val, NULL, 10);
+	} else if (is_key(line, pos, "SEQNUM")) {
+		evt->seqnum = strtoull(val, NULL, 10);
+	} else if (is_key(line, pos, "DISK_MEDIA_CHANGE")) {
+		evt->media_change = !strcmp(val, "1");
+	} else if (is_key(line, pos, "USEC_INITIALIZED")) {
+		/* Set by udev for RUN environment, all
+		 * ID_* properties are already probed. */
+		evt->probed = 1;
 	} else {
 		return;
 	}
@@ -53,16 +87,24 @@ int main(int argc, char *argv[])
 	char *buf = dbuf;
 	struct evtlv *ev;
 	struct diskev evt;
-	int magic = EVHEAD_MAGIC;
+	int *magic;
+	size_t len;
+	struct diskstat snap;
 
 	if (argc > 1 && !strcmp(argv[1], "-d")) {
 		log_debug(1);
 		log_level(LL_DEBUG);
 	}
 
-	memset(&evt, 0, sizeof(evt));
+	/* Print daemon status page */
+	if (argc > 1 && !strcmp(argv[argc - 1], "-s")) {
+		if (stat_read(&snap))
+			die("Cannot read status page '%s'", STAT_FILE);
+		stat_dump(stdout, &snap);
+		return 0;
+	}
 
-	sock = evsock_connect();
+	memset(&evt, 0, sizeof(evt));
 
 	for (env = environ; *env; ++env)
 		update(&evt, *env);
@@ -70,17 +112,31 @@ int main(int argc, char *argv[])
 	if (ev_validate(&evt))
 		die("Invalid event params");
 
-	ev = (struct evtlv *)buf;
+	/* Magic and event group are sent as single
+	 * datagram, so they cannot be split apart. */
+	magic = (int *)buf;
+	*magic = EVHEAD_WORD;
+	ev = (struct evtlv *)(buf + sizeof(*magic));
 	ev->type = EVTYPE_GROUP;
-	ev->length = evev_build(buf + sizeof(*ev), size - sizeof(*ev), &evt);
+	ev->length = evev_build(ev->value, size - sizeof(*magic) - sizeof(*ev), &evt);
 	if (!ev->length)
 		die("Failed to build event");
 
+	len = sizeof(*magic) + ev->length + sizeof(*ev);
+
+	/* Daemon is not up yet, i.e. early boot,
+	 * leave event for it to pick up on start. */
+	sock = evsock_connect();
+	if (sock < 0) {
+		vinfo("Spooling event, size %zu", len);
+		if (evsock_spool(buf, len))
+			die("Cannot spool event data");
+		return 0;
+	}
+
 	vinfo("Sending event, size %zu", ev->length + sizeof(*ev));
 
-	if (evsock_write(sock, (char *)&magic, sizeof(magic)))
-		die("Cannot write event magic");
-	if (evsock_write(sock, buf, ev->length + sizeof(*ev)))
+	if (evsock_write(sock, buf, len))
 		die("Cannot write event data");
 
 	evsock_disconnect(sock);
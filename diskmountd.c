@@ -1,6 +1,7 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,21 +14,35 @@
 #include <sys/mount.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
-#ifdef WITH_LIBMOUNT
-#include <libmount/libmount.h>
-#endif
 
 #include "util.h"
+#include "rcu.h"
 #include "diskconf.h"
 #include "disktab.h"
 #include "diskev.h"
+#include "diskscan.h"
 #include "nlsock.h"
 #include "evsock.h"
-
-#define EV_SCHED_TIME 1
+#include "handoff.h"
+#include "diskstat.h"
+#include "trace.h"
+#include "workq.h"
+#include "diskmnt.h"
+#include "drain.h"
+
+/* Debounce of add and remove events, ms */
+#define EV_SCHED_TIME 1000
+#define EV_REMOVE_TIME 100
+#define GONE_DETACH_TIME 1000
+#define LOOP_TIMEOUT 500
+#define SPOOL_INTERVAL 1000
+#define WORKERS_DEFAULT 4
+#define FSCK_DEFAULT 2
 
 struct diskmnt_ctx {
 	int verbosity;
@@ -35,6 +50,16 @@ struct diskmnt_ctx {
 	int kevent;
 	int monitor;
 	int debug;
+	int reload_umount;
+	int compile;
+	int workers;
+	/* Concurrent filesystem checks */
+	int fsck_max;
+	/* Unmount deadline on exit, ms */
+	unsigned int drain;
+	/* Binary path and arguments for re-exec */
+	char exe[PATH_MAX];
+	char **argv;
 #ifdef WITH_UGID
 	int uid;
 	int gid;
@@ -50,84 +75,442 @@ static void sigterm(int signo)
 	quit = 1;
 }
 
-static int perform_mount(const char *device, const char *point,
-			  const char *type, unsigned long flags, const char *opts)
+static int reload;
+static void sighup(int signo)
 {
-#if defined(WITH_LIBMOUNT)
-	struct libmnt_context *cxt;
+	vinfo("Got signal %u", signo);
+	reload = 1;
+}
 
-	mnt_init_debug(0);
-	cxt = mnt_new_context();
-	if (!cxt) {
-		verror("Failed to allocate MNT context");
-		return -1;
-	}
+static int dump_trace;
+static void sigusr1(int signo)
+{
+	dump_trace = 1;
+}
 
-	if (mnt_context_enable_verbose(cxt, 1)) {
-		verror("Failed to set MNT verbose");
-	}
+static int upgrade;
+static void sigusr2(int signo)
+{
+	vinfo("Got signal %u", signo);
+	upgrade = 1;
+}
 
-	if (mnt_context_append_options(cxt, opts ? opts : "rw")) {
-		verror("Failed to set MNT 'rw' options '%s'", opts);
-		goto fail;
-	}
+static inline dev_t devno(struct diskev *evt)
+{
+	return evt->major ? makedev(evt->major, evt->minor) : 0;
+}
 
-	if (mnt_context_set_fstype(cxt, type)) {
-		verror("Failed to set MNT type '%s'", type);
-		goto fail;
-	}
+/*
+ * Remove is late and belongs to previous disk when its disk
+ * sequence differs from the one recorded at mount time.
+ * Events without sequence cannot tell, they are never stale.
+ */
+static int is_stale_remove(struct diskev *evt, const char *point)
+{
+	unsigned long long diskseq;
+
+	if (!evt->diskseq)
+		return 0;
+
+	if (!tab_find_point(point, NULL, &diskseq) || !diskseq)
+		return 0;
+
+	return evt->diskseq != diskseq;
+}
+
+/*
+ * Mounted device left the system: its remove carries disk
+ * sequence recorded at mount, or device number already holds
+ * another disk. Event then targets the mounted incarnation.
+ */
+static int remove_gone(struct diskev *evt, unsigned long long carried)
+{
+	unsigned long long diskseq = 0;
+	char *point;
+
+	point = tab_find(devno(evt), 0, evt->device);
+	if (!point || !tab_find_point(point, NULL, &diskseq) || !diskseq)
+		return 0;
+
+	/* Different sequence carried by event is stale remove */
+	if (carried && carried != diskseq)
+		return 0;
+	/* Sequence looked up now, device may still be there */
+	if (!carried && (!evt->diskseq || evt->diskseq == diskseq))
+		return 0;
+
+	evt->diskseq = diskseq;
+	evt->gone = 1;
+
+	return 1;
+}
+
+struct media {
+	struct diskev *evt;
+	int cnt;
+};
+
+static void media_gone_entry(const char *devfile, const char *mntfile,
+			     dev_t dev, unsigned long long diskseq,
+			     int mnt_id, void *arg)
+{
+	struct media *media = arg;
+	struct diskev *evt = media->evt;
+	struct diskev rm;
+
+	/* Disk itself or one of its partitions */
+	if (!(evt->major && dev == devno(evt)) && strcmp(devfile, evt->device) &&
+	    !dev_is_part(devfile, evt->device))
+		return;
+	if (!diskseq || diskseq == evt->diskseq)
+		return;
+
+	memset(&rm, 0, sizeof(rm));
+	rm.action = strdup("remove");
+	rm.device = strdup(devfile);
+	rm.major = major(dev);
+	rm.minor = minor(dev);
+	rm.diskseq = diskseq;
+	rm.gone = 1;
+	rm.recv = evt->recv;
+	ev_insert(&rm, 0);
+	media->cnt++;
+}
 
-	if (mnt_context_set_source(cxt, device)) {
-		verror("Failed to set MNT source '%s'", device);
-		goto fail;
+/*
+ * Media of disk was pulled or replaced: kernel reports media
+ * change with disk sequence moved on. Mounts of the disk and
+ * its partitions from before are gone, queued for detach.
+ */
+static int media_gone(struct diskev *evt)
+{
+	struct media media = { evt, 0 };
+
+	if (!evt->diskseq)
+		return 0;
+
+	tab_walk(media_gone_entry, &media);
+
+	return media.cnt;
+}
+
+static int mount_device(const char *device, const char *fs,
+			const struct diskmatch *match)
+{
+	const char *point = match->point;
+
+	if (mkdir(point, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH))
+		verror("Failed to create create dir '%s'", point);
+#ifdef WITH_UGID
+	if (ctx.uid && ctx.gid && chown(point, ctx.uid, ctx.gid))
+		verror("Failed to chown created dir '%s'", point);
+#endif
+
+	return perform_mount(device, fs, MS_NOSUID | MS_NOATIME, match);
+}
+
+struct mount_work {
+	struct work work;
+	struct diskev evt;
+	/* Mount point, type and options */
+	struct diskmatch match;
+	const char *fs;
+	int umount;
+	int detach;
+	/* Filesystem check before mount */
+	int check;
+	int check_ret;
+	int check_err;
+	uint64_t check_usec;
+	struct exec_res check_res;
+	int ret;
+	int err;
+	/* In flight works, event loop only */
+	struct list_head node;
+};
+
+static struct list_head mount_works = LIST_HEAD_INIT(mount_works);
+/* Filesystem checks submitted */
+static int checks;
+
+static int mount_work_check(struct mount_work *mw)
+{
+	struct diskev *evt = &mw->evt;
+	uint64_t start;
+
+	start = mono_usec();
+	trace_event(TRACE_CHECK, evt, 0, 0);
+	mw->check_ret = perform_check(evt->device, mw->fs, &mw->check_res);
+	mw->check_err = mw->check_ret ? errno : 0;
+	mw->check_usec = mono_usec() - start;
+	trace_event(TRACE_CHECKED, evt, mw->check_usec, mw->check_err);
+
+	return mw->check_ret;
+}
+
+static void mount_work_run(struct work *w)
+{
+	struct mount_work *mw = container_of(w, struct mount_work, work);
+	struct diskev *evt = &mw->evt;
+	uint64_t start;
+
+	start = mono_usec();
+	if (mw->umount) {
+		trace_event(TRACE_UMOUNT, evt, 0, 0);
+		mw->ret = perform_umount(evt->device, mw->match.point, mw->detach);
+	} else if (mw->check && mount_work_check(mw)) {
+		mw->ret = -1;
+		errno = EUCLEAN;
+	} else {
+		start = mono_usec();
+		trace_event(TRACE_MOUNT, evt, 0, 0);
+		mw->ret = mount_device(evt->device, mw->fs, &mw->match);
 	}
+	mw->err = mw->ret ? errno : 0;
+	trace_event(mw->umount ? TRACE_UMOUNTED : TRACE_MOUNTED, evt,
+		    mono_usec() - start, mw->err);
+}
+
+static void coldplug_device(struct diskev *evt, void *arg);
+
+/* Disks nested below new mount may be present already */
+static void rescan_nested(const char *point)
+{
+	int cnt = 0;
+
+	scan_devices(coldplug_device, &cnt);
+	info("Rescan for mounts nested in '%s' queued %i devices", point, cnt);
+}
+
+/* Time from kernel remove to detached mount */
+static void report_gone(struct diskev *evt, const char *point)
+{
+	unsigned long long lat = (mono_usec() - evt->recv) / 1000;
 
-	if (mnt_context_set_target(cxt, point)) {
-		verror("Failed to set MNT target '%s'", point);
-		goto fail;
+	if (lat > GONE_DETACH_TIME)
+		warn("Detached removed '%s' from '%s' in %llu ms, over %u ms deadline",
+		     evt->device, point, lat, GONE_DETACH_TIME);
+	else
+		info("Detached removed '%s' from '%s' in %llu ms",
+		     evt->device, point, lat);
+}
+
+static void report_check(struct mount_work *mw)
+{
+	struct exec_res *res = &mw->check_res;
+	const char *device = mw->evt.device;
+	unsigned long long ms = mw->check_usec / 1000;
+
+	if (res->timeout)
+		error("Check of '%s' timed out after %llu ms", device, ms);
+	else if (mw->check_ret && mw->check_err != EIO)
+		error("Failed to check '%s': %u (%s)", device,
+		      mw->check_err, strerror(mw->check_err));
+	else if (mw->check_ret)
+		error("Check of '%s' failed in %llu ms, status %i: %s", device, ms,
+		      WIFEXITED(res->status) ? WEXITSTATUS(res->status) : -1, res->err);
+	else if (WIFEXITED(res->status) && WEXITSTATUS(res->status))
+		warn("Check of '%s' corrected errors in %llu ms: %s", device, ms, res->err);
+	else
+		info("Checked '%s' (%s) in %llu ms", device, mw->fs, ms);
+}
+
+static void mount_work_done(struct work *w)
+{
+	struct mount_work *mw = container_of(w, struct mount_work, work);
+	struct diskev *evt = &mw->evt;
+	const char *point = mw->match.point;
+
+	if (mw->check) {
+		checks--;
+		if (!w->canceled)
+			report_check(mw);
 	}
 
-	if (mnt_context_set_mflags(cxt, flags)) {
-		verror("Failed to set MNT flags '%lu'", flags);
-		goto fail;
+	if (w->canceled) {
+		info("Canceled %s of '%s' on shutdown",
+		     mw->umount ? "unmount" : "mount", evt->device);
+	} else if (mw->umount && mw->ret) {
+		error("Failed to unmount '%s' from '%s': %u (%s)",
+		      evt->device, point, mw->err, strerror(mw->err));
+		stat_count(STAT_UMOUNT_FAILS);
+	} else if (mw->umount) {
+		tab_del(devno(evt), evt->diskseq, evt->device);
+		stat_count(STAT_UMOUNTS);
+		if (evt->gone)
+			report_gone(evt, point);
+	} else if (mw->ret) {
+		error("Failed to mount '%s' to '%s', type '%s', opts '%s': %u (%s)",
+		      evt->device, point, mw->fs, mw->match.opts,
+		      mw->err, strerror(mw->err));
+		stat_count(STAT_MOUNT_FAILS);
+	} else {
+		tab_add(evt->device, point, devno(evt), evt->diskseq);
+		stat_count(STAT_MOUNTS);
+		if (mw->match.nested)
+			rescan_nested(point);
 	}
 
-	if (mnt_context_is_restricted(cxt)) {
-		vwarn("Mounting is restricted");
+	list_del(&mw->node);
+	ev_free(evt);
+	free(mw);
+}
+
+static struct mount_work *mount_work_new(struct diskev *evt, const char *point)
+{
+	struct mount_work *mw;
+
+	mw = calloc(1, sizeof(*mw));
+	if (!mw)
+		die("malloc() failed");
+
+	/* Same device or mount point operations stay ordered */
+	mw->work.keys[0] = hash_str(evt->device);
+	mw->work.keys[1] = hash_str(point);
+	mw->work.run = mount_work_run;
+	mw->work.done = mount_work_done;
+
+	return mw;
+}
+
+/*
+ * Checks on one physical disk run one at a time,
+ * partitions are keyed by their disk device number.
+ */
+static uint32_t spindle_key(struct diskev *evt)
+{
+	unsigned int maj = evt->major, min = evt->minor;
+	char path[64];
+	FILE *fp;
+
+	if (!evt->major)
+		return hash_str(evt->device);
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition", maj, min);
+	if (!access(path, F_OK)) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev", maj, min);
+		fp = fopen(path, "r");
+		if (fp && fscanf(fp, "%u:%u", &maj, &min) != 2) {
+			maj = evt->major;
+			min = evt->minor;
+		}
+		if (fp)
+			fclose(fp);
 	}
 
-	if (mnt_context_mount(cxt)) {
-		goto fail;
+	snprintf(path, sizeof(path), "spindle %u:%u", maj, min);
+	return hash_str(path);
+}
+
+static int spindle_busy(uint32_t spindle)
+{
+	uint32_t keys[WORK_KEYS] = { spindle, 0 };
+
+	return workq_busy(keys);
+}
+
+static int mount_work_busy(struct diskev *evt, const char *point)
+{
+	uint32_t keys[WORK_KEYS] = { hash_str(evt->device), point ? hash_str(point) : 0 };
+
+	return workq_busy(keys);
+}
+
+static int mount_point_busy(const char *point)
+{
+	uint32_t keys[WORK_KEYS] = { hash_str(point), 0 };
+
+	return workq_busy(keys);
+}
+
+/* Operation in progress below mount point */
+static int nested_busy(const char *point)
+{
+	struct mount_work *mw;
+
+	list_for_each_entry(mw, &mount_works, node) {
+		if (path_under(mw->match.point, point))
+			return 1;
 	}
 
 	return 0;
-fail:
-	mnt_free_context(cxt);
-	return 1;
-#elif defined(WITH_SHMOUNT)
-	char cmd[128];
-	snprintf(cmd, sizeof(cmd), "mount -t '%s' -o '%s' %s %s",
-		 type, opts ? opts : "rw", device, point);
-	return system(cmd);
-#else
-	return mount(device, point, fs, flags, data);
-#endif
 }
 
-static int perform_umount(const char *device, const char *point)
+struct nested {
+	const char *point;
+	int cnt;
+};
+
+static void parent_pending_event(struct diskev *evt, void *arg)
+{
+	struct nested *nest = arg;
+	struct diskmatch match;
+
+	if (nest->cnt || strcmp(evt->action, "add"))
+		return;
+	if (!conf_find(evt, &match) && !strcmp(match.point, nest->point))
+		nest->cnt++;
+}
+
+/* Parent disk is queued to be mounted, child would get shadowed */
+static int parent_pending(const char *parent)
 {
-#if defined(WITH_SHMOUNT)
-	char cmd[32];
-	snprintf(cmd, sizeof(cmd), "umount %s", point);
-	return system(cmd);
-#else
-	return umount(point);
-#endif
+	struct nested nest = { parent, 0 };
+
+	if (tab_find_point(parent, NULL, NULL))
+		return 0;
+
+	ev_walk(parent_pending_event, &nest);
+
+	return nest.cnt;
+}
+
+static void unmount_nested_entry(const char *devfile, const char *mntfile,
+				 dev_t devno, unsigned long long diskseq,
+				 int mnt_id, void *arg)
+{
+	struct nested *nest = arg;
+	struct diskev rm;
+
+	if (!path_under(mntfile, nest->point))
+		return;
+
+	info("Unmounting nested '%s' -> '%s' first", devfile, mntfile);
+	memset(&rm, 0, sizeof(rm));
+	rm.action = strdup("remove");
+	rm.device = strdup(devfile);
+	rm.major = major(devno);
+	rm.minor = minor(devno);
+	rm.diskseq = diskseq;
+	ev_insert(&rm, 0);
+	nest->cnt++;
+}
+
+/*
+ * Children unmount before parent, both when parent goes
+ * away and when it arrives late and would shadow them.
+ * Returns number of queued unmounts.
+ */
+static int unmount_nested(const char *point)
+{
+	struct nested nest = { point, 0 };
+
+	tab_walk(unmount_nested_entry, &nest);
+
+	return nest.cnt;
 }
 
-static void process_mount(struct diskev *evt)
+/*
+ * Decides on event and dispatches mount operation to workers.
+ * Returns 1 when event has to wait for operation in progress
+ * on the same device or mount point, event is kept intact.
+ */
+static int process_mount(struct diskev *evt)
 {
-	char *point, *fs, *opts;
+	struct diskmatch match;
+	struct mount_work *mw;
+	const char *point, *fs, *opts;
+	uint32_t spindle = 0;
 	char *device = evt->device;
 	char *action = evt->action;
 
@@ -139,83 +522,229 @@ static void process_mount(struct diskev *evt)
 		 * sanitize for add event. */
 		if (ev_sanitize(evt)) {
 			warn("Skip mount, cannot sanitize mount: '%s'", device);
-			return;
+			return 0;
 		}
+		ev_locate(evt);
+		trace_event(TRACE_SANITIZE, evt, evt->probed ?
+			    TRACE_SRC_UDEV : TRACE_SRC_PROBE, 0);
 
 		if (ctx.monitor) {
 			ev_dump(stdout, evt);
-			return;
+			return 0;
 		}
 
-		if (conf_find(evt, &point, &fs, &opts)) {
+		if (conf_find(evt, &match)) {
+			trace_event(TRACE_NOMATCH, evt, 0, 0);
 			debug("Skip mount, no confiured mount: '%s'", device);
-			return;
+			return 0;
+		}
+		trace_event(TRACE_MATCH, evt, match.rule, 0);
+		point = match.point;
+		fs = match.fs;
+		opts = match.opts;
+
+		if (mount_work_busy(evt, point)) {
+			debug("Delay mount, '%s' is busy", device);
+			return 1;
+		}
+
+		if (tab_find(devno(evt), evt->diskseq, device)) {
+			debug("Skip mount, already mounted: '%s'", device);
+			return 0;
+		}
+
+		/* Parents mount before children */
+		if (match.parent && (mount_point_busy(match.parent) ||
+				     parent_pending(match.parent))) {
+			debug("Delay mount, parent '%s' is pending", match.parent);
+			return 1;
+		}
+
+		if (match.nested && nested_busy(point)) {
+			debug("Delay mount, nested mounts of '%s' are busy", point);
+			return 1;
+		}
+
+		if (match.nested && !evt->cascaded && unmount_nested(point)) {
+			evt->cascaded = 1;
+			return 1;
+		}
+
+		if (match.fsck) {
+			spindle = spindle_key(evt);
+			if (checks >= ctx.fsck_max || spindle_busy(spindle)) {
+				debug("Delay mount, check of '%s' has to wait", device);
+				return 1;
+			}
 		}
 
 		if (!fs)
 			fs = evt->filesys;
 		if (!fs) {
 			error("Skip mount, unknown file system: '%s'", device);
-			return;
+			return 0;
 		}
 
 		info("Mounting '%s' -> '%s' (%s, %s)", device, point, fs, opts);
 
-		if (mkdir(point, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH))
-			verror("Failed to create create dir '%s'", point);
-#ifdef WITH_UGID
-		if (ctx.uid && ctx.gid && chown(point, ctx.uid, ctx.gid))
-			verror("Failed to chown created dir '%s'", point);
-#endif
-
-		if (perform_mount(device, point, fs, MS_NOSUID | MS_NOATIME, opts))
-			error("Failed to mount '%s' to '%s', type '%s', opts '%s': %u (%s)",
-			      device, point, fs, opts, errno, strerror(errno));
-		else
-			tab_add(device, point);
+		mw = mount_work_new(evt, point);
+		memcpy(&mw->match, &match, sizeof(match));
+		if (match.fs)
+			mw->match.fs = mw->match.fs_buf;
+		if (match.opts)
+			mw->match.opts = mw->match.opts_buf;
+		if (match.data)
+			mw->match.data = mw->match.data_buf;
+		if (match.parent)
+			mw->match.parent = mw->match.parent_buf;
+		mw->fs = match.fs ? mw->match.fs : evt->filesys;
+		if (match.fsck) {
+			/* Check holds its disk until mounted */
+			mw->work.keys[2] = spindle;
+			mw->check = 1;
+			checks++;
+		}
 	} else if (!strcmp(action, "remove")) {
 		if (ctx.monitor) {
 			ev_dump(stdout, evt);
-			return;
+			return 0;
 		}
 
-		point = tab_find(device);
+		point = tab_find(devno(evt), evt->diskseq, device);
 		if (!point) {
+			if (mount_work_busy(evt, NULL)) {
+				debug("Delay unmount, '%s' is busy", device);
+				return 1;
+			}
 			debug("Skip unmount, not mounted '%s'", device);
-			return;
+			return 0;
 		}
 
-		info("Unmounting '%s' -> '%s'", device, point);
+		if (mount_work_busy(evt, point)) {
+			debug("Delay unmount, '%s' is busy", device);
+			return 1;
+		}
 
-		if (perform_umount(device, point))
-			error("Failed to unmount '%s' from '%s': %u (%s)",
-			      device, point, errno, strerror(errno));
-		else
-			tab_del(device);
+		if (is_stale_remove(evt, point)) {
+			info("Skip unmount, '%s' -> '%s' belongs to new disk",
+			     device, point);
+			return 0;
+		}
+
+		/* Children unmount before parents */
+		if (nested_busy(point)) {
+			debug("Delay unmount, nested mounts of '%s' are busy", point);
+			return 1;
+		}
+
+		if (!evt->cascaded && unmount_nested(point)) {
+			evt->cascaded = 1;
+			return 1;
+		}
+
+		mw = mount_work_new(evt, point);
+		snprintf(mw->match.point, sizeof(mw->match.point), "%s", point);
+		mw->umount = 1;
+		mw->detach = conf_point_detach(point);
+		/* Nothing to flush to, drop mount from namespace at once */
+		if (evt->gone && mw->detach != CONF_DETACH_NEVER) {
+			info("Detaching removed '%s' -> '%s'", device, point);
+			mw->detach = CONF_DETACH_ALWAYS;
+		} else {
+			info("Unmounting '%s' -> '%s'", device, point);
+		}
 	} else {
-		warn("Unknown event '%s' mounting '%s' -> '%s' (%s, %s)",
-		     action, device, point, fs, opts);
+		warn("Unknown event '%s' mounting '%s'", action, device);
+		return 0;
 	}
+
+	/* Work takes over event properties */
+	memcpy(&mw->evt, evt, sizeof(*evt));
+	memset(evt, 0, sizeof(*evt));
+	list_add_tail(&mw->node, &mount_works);
+	workq_submit(&mw->work);
+
+	return 0;
 }
 
 static void process_events(void)
 {
-	struct diskev *tmp;
+	LLIST_HEAD(deferred);
+	struct diskev *tmp, *next;
 
 	while ((tmp = ev_next())) {
 		/* Find mount point and do mount */
-		process_mount(tmp);
+		if (process_mount(tmp)) {
+			list_add_tail(&tmp->list, &deferred);
+			continue;
+		}
 
 		ev_free(tmp);
 		free(tmp);
 	}
+
+	/* Retried once operations in progress complete */
+	list_for_each_entry_safe(tmp, next, &deferred, list) {
+		list_del(&tmp->list);
+		ev_insert(tmp, 0);
+		free(tmp);
+	}
+}
+
+static void count_event(struct diskev *evt, void *arg)
+{
+	(*(uint32_t *)arg)++;
+}
+
+static void publish_status(void)
+{
+	uint32_t depth = 0;
+
+	ev_walk(count_event, &depth);
+
+	stat_begin(depth);
+	tab_walk(stat_mount, NULL);
+	stat_end();
 }
 
-static void schedule_event(struct diskev *evt)
+static void schedule_event(struct diskev *evt, int src)
 {
+	unsigned long long carried = evt->diskseq;
 	struct diskev *tmp;
+	int cnt;
+
+	stat_count(STAT_EVENTS);
+	ev_identify(evt);
+	evt->recv = mono_usec();
+	trace_event(TRACE_RECV, evt, src, 0);
+
+	if (evt->media_change) {
+		cnt = media_gone(evt);
+		if (cnt)
+			info("Media of '%s' changed, detaching %i mounts", evt->device, cnt);
+		ev_free(evt);
+		return;
+	}
 
 	tmp = ev_find(evt);
+	if (!tmp && !strcmp(evt->action, "remove")) {
+		/* Gone device skips debounce */
+		if (remove_gone(evt, carried)) {
+			debug("Scheduling remove of gone '%s'", evt->device);
+			ev_insert(evt, 0);
+			return;
+		}
+		/* Partitions of pulled disk go out in one batch */
+		tmp = ev_find_disk(evt);
+		if (tmp) {
+			debug("Batching remove of '%s' with '%s'", evt->device, tmp->device);
+			ev_insert(evt, (int64_t)tmp->ts - (int64_t)(mono_usec() / 1000));
+			return;
+		}
+		debug("Scheduling new remove event");
+		ev_insert(evt, EV_REMOVE_TIME);
+		return;
+	}
 	if (!tmp) {
 		debug("Scheduling new event");
 		ev_insert(evt, EV_SCHED_TIME);
@@ -225,10 +754,12 @@ static void schedule_event(struct diskev *evt)
 	/* Implies add or remove action. */
 	if (strcmp(evt->action, tmp->action)) {
 		debug("Inverse event already in queue, removing");
+		trace_event(TRACE_CANCEL, evt, 0, 0);
 		ev_remove(tmp);
 		return;
 	} else {
 		debug("Similar event already in queue, ignoring");
+		trace_event(TRACE_COALESCE, evt, 0, 0);
 		/* Shall we refresh event time stamp? */
 	}
 
@@ -272,7 +803,7 @@ static void handle_kobj_event(int sock)
 		return;
 	}
 
-	schedule_event(&evt);
+	schedule_event(&evt, TRACE_SRC_KERNEL);
 }
 
 static void handle_udev_event(int sock)
@@ -319,36 +850,33 @@ static void handle_udev_event(int sock)
 		return;
 	}
 
-	schedule_event(&evt);
+	schedule_event(&evt, TRACE_SRC_UDEV);
 }
 
-static void handle_local_event(int sock)
+static void parse_local_event(char *buf, size_t len, int src)
 {
 	struct diskev evt;
 	struct evtlv *evh;
 	int magic;
-	size_t len;
-	size_t size = getpagesize() * 2;
-	char dbuf[size];
-	char *buf = dbuf;
 
-	len = sizeof(magic);
-	if (evsock_read(sock, (char *)&magic, &len)) {
-		error("Failed event magic receive");
+	if (len < sizeof(magic) + sizeof(*evh)) {
+		info("Short event size %zu", len);
 		return;
 	}
 
-	if (magic != EVHEAD_MAGIC) {
-		info("Invalid event magic");
+	memcpy(&magic, buf, sizeof(magic));
+	if (magic == EVHEAD_MAGIC) {
+		error("Event from diskmount of older wire format, rebuild client");
 		return;
 	}
-
-	len = size;
-	if (evsock_read(sock, buf, &len)) {
-		error("Failed event header receive");
+	if (magic != EVHEAD_WORD) {
+		info("Invalid event magic");
 		return;
 	}
 
+	buf += sizeof(magic);
+	len -= sizeof(magic);
+
 	evh = (struct evtlv *)buf;
 	if (evh->type != EVTYPE_GROUP || evh->length != (len - sizeof(*evh))) {
 		error("Invalid event header, type %i, size %u/%zu",
@@ -363,7 +891,117 @@ static void handle_local_event(int sock)
 		return;
 	}
 
-	schedule_event(&evt);
+	schedule_event(&evt, src);
+}
+
+static void handle_local_event(int sock)
+{
+	size_t len;
+	size_t size = getpagesize() * 2;
+	char dbuf[size];
+	char *buf = dbuf;
+
+	len = size;
+	if (evsock_read(sock, buf, &len)) {
+		error("Failed event receive");
+		return;
+	}
+
+	parse_local_event(buf, len, TRACE_SRC_LOCAL);
+}
+
+static void drain_local_event(char *buf, size_t len, void *arg)
+{
+	parse_local_event(buf, len, TRACE_SRC_SPOOL);
+}
+
+static void coldplug_device(struct diskev *evt, void *arg)
+{
+	int *cnt = arg;
+
+	trace_event(TRACE_RECV, evt, TRACE_SRC_SCAN, 0);
+	ev_identify(evt);
+	ev_insert(evt, 0);
+	(*cnt)++;
+}
+
+/*
+ * Queue devices which were present before start, they
+ * are mounted by workers in parallel like live events.
+ * Mounted devices are skipped when events are processed.
+ */
+static void coldplug(void)
+{
+	int cnt = 0;
+
+	scan_devices(coldplug_device, &cnt);
+
+	info("Coldplug queued %i devices", cnt);
+}
+
+static void reconcile_device(struct diskev *evt, void *arg)
+{
+	struct diskconf *old = arg;
+	struct diskmatch cur, prev;
+	struct diskev rm;
+	const char *mounted;
+	int has_cur, has_prev;
+
+	if (ev_sanitize(evt)) {
+		ev_free(evt);
+		return;
+	}
+
+	mounted = tab_find(devno(evt), evt->diskseq, evt->device);
+	has_cur = !conf_find(evt, &cur);
+	has_prev = !conf_find_at(old, evt, &prev);
+
+	if (mounted && (!has_cur || strcmp(cur.point, mounted))) {
+		if (!ctx.reload_umount) {
+			info("Keeping '%s' -> '%s' mounted, rule changed",
+			     evt->device, mounted);
+			ev_free(evt);
+			return;
+		}
+
+		info("Reload unmounts '%s' -> '%s'", evt->device, mounted);
+		memset(&rm, 0, sizeof(rm));
+		rm.action = strdup("remove");
+		rm.device = strdup(evt->device);
+		rm.major = evt->major;
+		rm.minor = evt->minor;
+		rm.diskseq = evt->diskseq;
+		ev_insert(&rm, 0);
+		mounted = NULL;
+	}
+
+	/* Mount only devices which gained rule or
+	 * whose mount point was changed by reload. */
+	if (!mounted && has_cur &&
+	    (!has_prev || strcmp(cur.point, prev.point))) {
+		info("Reload mounts '%s' -> '%s'", evt->device, cur.point);
+		ev_insert(evt, 0);
+		return;
+	}
+
+	ev_free(evt);
+}
+
+static void reload_config(void)
+{
+	struct diskconf *old;
+
+	old = conf_reload();
+	if (!old)
+		return;
+
+	/* Mounts skipped as not configured may be now */
+	tab_rescan();
+
+	if (!ctx.monitor)
+		scan_devices(reconcile_device, old);
+
+	conf_release(old);
 }
 
 #ifdef WITH_UGID
@@ -391,6 +1029,11 @@ print_usage(void)
 		"  -b, --background    Run as daemon.\n"
 		"  -m, --monitor       Event monitoring.\n"
 		"  -k, --kevent        Force kernel uevent.\n"
+		"  -r, --reload-umount Unmount disks which lost rule on reload.\n"
+		"  -C, --compile-config Compile binary config image and exit.\n"
+		"  -w, --workers <num> Mount worker threads (default 4, 0 inline).\n"
+		"  -F, --fsck-max <num> Concurrent filesystem checks (default 2).\n"
+		"  -D, --drain <ms>    Sync and unmount managed disks on exit within deadline.\n"
 		"  -v, --verbose       Increase verbosity.\n"
 		"  -d, --debug         Debug mode.\n"
 #ifdef WITH_UGID
@@ -407,6 +1050,11 @@ static struct option long_options[] =
 	{ "background",	no_argument,       0, 'b' },
 	{ "monitor",	no_argument,       0, 'm' },
 	{ "kevent",	no_argument,       0, 'k' },
+	{ "reload-umount", no_argument,    0, 'r' },
+	{ "compile-config", no_argument,   0, 'C' },
+	{ "workers",	required_argument, 0, 'w' },
+	{ "fsck-max",	required_argument, 0, 'F' },
+	{ "drain",	required_argument, 0, 'D' },
 	{ "verbose",	no_argument,       0, 'v' },
 	{ "debug",	no_argument,       0, 'd' },
 #ifdef WITH_UGID
@@ -422,8 +1070,10 @@ parse_options(int argc, char *argv[])
 	int opt, index;
 
 	ctx.verbosity = 2;
+	ctx.workers = WORKERS_DEFAULT;
+	ctx.fsck_max = FSCK_DEFAULT;
 
-	while ((opt = getopt_long(argc, argv, "bdg:hkmu:v", long_options, &index)) != -1) {
+	while ((opt = getopt_long(argc, argv, "bCdD:F:g:hkmru:vw:", long_options, &index)) != -1) {
 		switch(opt) {
 		case 'b':
 			ctx.daemonize = 1;
@@ -434,6 +1084,23 @@ parse_options(int argc, char *argv[])
 		case 'm':
 			ctx.monitor = 1;
 			break;
+		case 'r':
+			ctx.reload_umount = 1;
+			break;
+		case 'C':
+			ctx.compile = 1;
+			break;
+		case 'w':
+			ctx.workers = atoi(optarg);
+			break;
+		case 'F':
+			ctx.fsck_max = atoi(optarg);
+			if (ctx.fsck_max < 1)
+				ctx.fsck_max = 1;
+			break;
+		case 'D':
+			ctx.drain = strtoul(optarg, NULL, 10);
+			break;
 		case 'v':
 			ctx.verbosity++;
 			break;
@@ -456,6 +1123,19 @@ parse_options(int argc, char *argv[])
 			exit(EXIT_FAILURE);
 		}
 	}
+
+	/* Workers read config and table, event loop too */
+	if (ctx.workers > RCU_MAX_THREADS - 1) {
+		warn("Limiting workers to %i", RCU_MAX_THREADS - 1);
+		ctx.workers = RCU_MAX_THREADS - 1;
+	}
+
+	/* Checks hold workers for long, leave one for mounts */
+	if (ctx.workers > 1 && ctx.fsck_max > ctx.workers - 1) {
+		warn("Limiting concurrent checks to %i of %i workers",
+		     ctx.workers - 1, ctx.workers);
+		ctx.fsck_max = ctx.workers - 1;
+	}
 }
 
 int main(int argc, char *argv[])
@@ -463,16 +1143,37 @@ int main(int argc, char *argv[])
 	int kern_feed;
 	int evsock;
 	int nlsock;
+	int cfsock;
+	int mtsock;
+	int wqsock = -1;
+	int handed;
+	struct handoff ho;
+	ssize_t len;
+	int missed = 0;
+	uint64_t spool_next, drain_end, now;
 
 	parse_options(argc, argv);
 
+	/* Resolve now, upgrade replaces file on disk */
+	len = readlink("/proc/self/exe", ctx.exe, sizeof(ctx.exe) - 1);
+	if (len > 0)
+		ctx.exe[len] = '\0';
+	ctx.argv = argv;
+
 	log_debug(ctx.debug);
 	log_level(ctx.verbosity);
+	trace_init();
+
+	if (ctx.compile)
+		return conf_compile_image() ? EXIT_FAILURE : EXIT_SUCCESS;
 
 	/* Load mount config */
 	conf_load();
+	/* Previous instance hands over its state */
+	handed = getenv(HANDOFF_ENV) != NULL;
 	/* Load configured mounts */
-	tab_load();
+	if (!handed)
+		tab_load();
 
 	if (ctx.monitor) {
 		conf_dump(stdout);
@@ -480,7 +1181,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (!ctx.monitor && ctx.daemonize) {
-		if (daemon(0, 0) == -1)
+		if (!handed && daemon(0, 0) == -1)
 			die("daemon() failed\n");
 
 		syslog_open();
@@ -488,8 +1189,21 @@ int main(int argc, char *argv[])
 
 	signal(SIGTERM, sigterm);
 	signal(SIGQUIT, sigterm);
+	signal(SIGHUP, sighup);
+	signal(SIGUSR1, sigusr1);
+	signal(SIGUSR2, sigusr2);
+
+	if (handed && handoff_load(&ho)) {
+		warn("Starting without handoff state");
+		handed = 0;
+		tab_load();
+	}
 
-	if (!ctx.kevent && !access("/run/udev/control", F_OK)) {
+	if (handed) {
+		kern_feed = ho.kern_feed;
+		nlsock = ho.nlsock;
+		evsock = ho.evsock;
+	} else if (!ctx.kevent && !access("/run/udev/control", F_OK)) {
 		debug("Subscribed to udev events");
 		kern_feed = 0;
 	} else {
@@ -497,19 +1211,42 @@ int main(int argc, char *argv[])
 		kern_feed = 1;
 	}
 
-	if (kern_feed)
-		nlsock = nlsock_open(UEVENT_KERNEL);
-	else
-		nlsock = nlsock_open(UEVENT_UDEV);
+	if (!handed) {
+		if (kern_feed)
+			nlsock = nlsock_open(UEVENT_KERNEL);
+		else
+			nlsock = nlsock_open(UEVENT_UDEV);
+
+		evsock = evsock_open();
+		/* Events spooled by clients before socket
+		 * was up, coalesced as they are scheduled. */
+		evsock_drain(drain_local_event, NULL);
+	}
+	spool_next = mono_usec() + SPOOL_INTERVAL * 1000ULL;
+	cfsock = conf_watch();
+	mtsock = tab_watch();
+
+	if (!ctx.monitor) {
+		stat_open();
+		wqsock = workq_init(ctx.workers);
+	}
 
-	evsock = evsock_open();
+	/* Uevents arriving meanwhile wait in sockets */
+	if (!ctx.monitor && !handed)
+		coldplug();
 
 	while (!quit) {
-		struct timeval timeout = { 0, 500*1000 };
-		int maxfd = -1, n;
-		fd_set rfds;
+		struct timeval timeout = { 0, LOOP_TIMEOUT * 1000 };
+		int maxfd = -1, n, due;
+		fd_set rfds, efds;
+
+		/* Wake up in time for batched removes */
+		due = ev_due();
+		if (due >= 0 && due < LOOP_TIMEOUT)
+			timeout.tv_usec = due * 1000;
 
 		FD_ZERO(&rfds);
+		FD_ZERO(&efds);
 
 		FD_SET(nlsock, &rfds);
 		maxfd = MAX(maxfd, nlsock);
@@ -517,7 +1254,22 @@ int main(int argc, char *argv[])
 		FD_SET(evsock, &rfds);
 		maxfd = MAX(maxfd, evsock);
 
-		n = select(maxfd + 1, &rfds, NULL, NULL, &timeout);
+		if (cfsock >= 0) {
+			FD_SET(cfsock, &rfds);
+			maxfd = MAX(maxfd, cfsock);
+		}
+
+		if (mtsock >= 0) {
+			FD_SET(mtsock, &efds);
+			maxfd = MAX(maxfd, mtsock);
+		}
+
+		if (wqsock >= 0) {
+			FD_SET(wqsock, &rfds);
+			maxfd = MAX(maxfd, wqsock);
+		}
+
+		n = select(maxfd + 1, &rfds, NULL, &efds, &timeout);
 		if (n < 0) {
 			if (errno == EINTR)
 				continue;
@@ -536,13 +1288,87 @@ int main(int argc, char *argv[])
 			handle_local_event(evsock);
 		}
 
-		process_events();
+		/* Clients which saw no socket while daemon
+		 * was starting may spool after first drain. */
+		if (mono_usec() >= spool_next) {
+			spool_next = mono_usec() + SPOOL_INTERVAL * 1000ULL;
+			evsock_drain(drain_local_event, NULL);
+		}
+
+		if (cfsock >= 0 && FD_ISSET(cfsock, &rfds)) {
+			if (conf_watch_check(cfsock))
+				reload = 1;
+		}
+
+		/* Mount operations completed by workers */
+		if (wqsock >= 0 && FD_ISSET(wqsock, &rfds))
+			workq_complete();
+
+		/* Mounts changed outside of daemon */
+		if (mtsock >= 0 && FD_ISSET(mtsock, &efds)) {
+			if (tab_sync())
+				warn("Failed to sync mount changes");
+		}
+
+		/* Swap config between events */
+		if (reload) {
+			reload = 0;
+			reload_config();
+		}
+
+		if (dump_trace) {
+			dump_trace = 0;
+			if (trace_dump(TRACE_FILE) < 0)
+				warn("Cannot dump trace to '%s'", TRACE_FILE);
+		}
+
+		/* Sockets stay open, so no event is lost;
+		 * operations in progress are let to finish,
+		 * queued events are handed over. */
+		if (upgrade && workq_idle()) {
+			upgrade = 0;
+			ho.nlsock = nlsock;
+			ho.evsock = evsock;
+			ho.kern_feed = kern_feed;
+			handoff_exec(ctx.exe, ctx.argv, &ho);
+		}
+
+		if (!upgrade)
+			process_events();
+
+		/* Event loop holds no snapshot references here */
+		rcu_reclaim();
+
+		publish_status();
 	}
 
+	if (!ctx.monitor && ctx.drain) {
+		/*
+		 * One deadline covers works in flight and drain: queued
+		 * works are dropped, helpers such as fsck are terminated
+		 * at once, drain gets whatever time is left.
+		 */
+		drain_end = mono_usec() + ctx.drain * 1000ULL;
+		exec_set_deadline(mono_usec());
+		missed = workq_stop(ctx.drain);
+		now = mono_usec();
+		missed += drain_mounts(drain_end > now ? (drain_end - now) / 1000 : 0);
+	} else {
+		workq_stop(0);
+	}
+	/* Threads of missed works and mounts still hold mount state */
+	if (!missed)
+		mount_release();
+
 	nlsock_close(nlsock);
 	evsock_close(evsock);
+	if (cfsock >= 0)
+		close(cfsock);
+	if (mtsock >= 0)
+		close(mtsock);
+	stat_close();
 
 	syslog_close();
 
-	return 0;
+	return missed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,111 @@
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "diskev.h"
+#include "diskscan.h"
+
+#define SYS_BLOCK "/sys/class/block"
+#define UDEV_DATA "/run/udev/data"
+
+static int scan_props(struct diskev *evt, const char *path, const char *prefix)
+{
+	FILE *fp;
+	char line[512];
+	size_t len = strlen(prefix);
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (strncmp(line, prefix, len))
+			continue;
+		ev_update(evt, line + len);
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+int scan_device(const char *name, struct diskev *evt)
+{
+	char path[256];
+	char link[256];
+	ssize_t len;
+
+	memset(evt, 0, sizeof(*evt));
+
+	/* Only partitions are mounted */
+	snprintf(path, sizeof(path), SYS_BLOCK "/%s/partition", name);
+	if (access(path, F_OK))
+		return 1;
+
+	snprintf(path, sizeof(path), SYS_BLOCK "/%s/uevent", name);
+	if (scan_props(evt, path, "")) {
+		vwarn("Cannot read device '%s' uevent", name);
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), SYS_BLOCK "/%s", name);
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len > 0) {
+		link[len] = '\0';
+		/* Relative link leads to "../../devices/..." */
+		if (strstr(link, "/devices/"))
+			evt->devpath = strdup(strstr(link, "/devices/"));
+	}
+
+	/* Udev database holds already probed properties */
+	snprintf(path, sizeof(path), UDEV_DATA "/b%u:%u", evt->major, evt->minor);
+	if (!scan_props(evt, path, "E:"))
+		evt->probed = 1;
+
+	evt->action = strdup("add");
+	if (!evt->subsys)
+		evt->subsys = strdup("block");
+
+	if (ev_check(evt) || ev_validate(evt)) {
+		ev_free(evt);
+		return -1;
+	}
+
+	vdebug("Scanned device '%s', %u:%u", evt->device, evt->major, evt->minor);
+
+	return 0;
+}
+
+int scan_devices(scan_cb cb, void *arg)
+{
+	struct dirent *dp;
+	struct diskev evt;
+	DIR *dfd;
+	int cnt = 0;
+
+	dfd = opendir(SYS_BLOCK);
+	if (!dfd) {
+		warn("Cannot open directory: '%s'", SYS_BLOCK);
+		return -1;
+	}
+
+	while ((dp = readdir(dfd)) != NULL) {
+		if (dp->d_name[0] == '.')
+			continue;
+		if (scan_device(dp->d_name, &evt))
+			continue;
+
+		cb(&evt, arg);
+		cnt++;
+	}
+
+	closedir(dfd);
+
+	vinfo("Scanned %i block partitions", cnt);
+
+	return cnt;
+}
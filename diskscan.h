@@ -0,0 +1,12 @@
+#ifndef _DISKSCAN_H
+#define _DISKSCAN_H
+
+#include "diskev.h"
+
+/* Callback takes over event properties */
+typedef void (*scan_cb)(struct diskev *evt, void *arg);
+
+int scan_device(const char *name, struct diskev *evt);
+int scan_devices(scan_cb cb, void *arg);
+
+#endif // _DISKSCAN_H
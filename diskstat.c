@@ -0,0 +1,236 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "util.h"
+#include "diskstat.h"
+
+#define STAT_READ_RETRIES 1000
+
+static struct diskstat *stat_page;
+/* Counters are kept aside, page is refreshed in one pass */
+static uint64_t stat_counters[STAT_COUNTERS];
+static int64_t stat_last[STAT_COUNTERS];
+
+static inline uint32_t stat_seq_load(struct diskstat *page)
+{
+	return __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+}
+
+static void stat_write_begin(struct diskstat *page)
+{
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+	/* Odd sequence must be visible before data */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void stat_write_end(struct diskstat *page)
+{
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Page is always created anew, so whatever is left under its
+ * name, i.e. link planted by other user, is never written to.
+ * Fresh page also starts with even sequence.
+ */
+int stat_open(void)
+{
+	struct stat st;
+	int fd;
+
+	if (unlink(STAT_FILE) && errno != ENOENT) {
+		warn("Cannot remove status page '%s': %s", STAT_FILE, strerror(errno));
+		return -1;
+	}
+
+	fd = open(STAT_FILE, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+		  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		warn("Cannot open status page '%s': %s", STAT_FILE, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid()) {
+		warn("Status page '%s' is not owned by daemon", STAT_FILE);
+		close(fd);
+		return -1;
+	}
+
+	if (ftruncate(fd, sizeof(*stat_page))) {
+		warn("Cannot size status page '%s': %s", STAT_FILE, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	stat_page = mmap(NULL, sizeof(*stat_page), PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+	close(fd);
+	if (stat_page == MAP_FAILED) {
+		stat_page = NULL;
+		warn("Cannot map status page '%s': %s", STAT_FILE, strerror(errno));
+		return -1;
+	}
+
+	stat_write_begin(stat_page);
+	stat_page->magic = STAT_MAGIC;
+	stat_page->version = STAT_VERSION;
+	stat_page->size = sizeof(*stat_page);
+	stat_page->pid = getpid();
+	stat_page->started = time(NULL);
+	stat_write_end(stat_page);
+
+	vdebug("Opened status page '%s'", STAT_FILE);
+
+	return 0;
+}
+
+void stat_close(void)
+{
+	if (!stat_page)
+		return;
+
+	stat_write_begin(stat_page);
+	stat_page->pid = 0;
+	stat_write_end(stat_page);
+
+	munmap(stat_page, sizeof(*stat_page));
+	stat_page = NULL;
+	unlink(STAT_FILE);
+}
+
+void stat_count(int counter)
+{
+	stat_counters[counter]++;
+	stat_last[counter] = time(NULL);
+}
+
+/* Starts page refresh, mounts are added with stat_mount() */
+void stat_begin(uint32_t queue_depth)
+{
+	if (!stat_page)
+		return;
+
+	stat_write_begin(stat_page);
+	stat_page->updated = time(NULL);
+	stat_page->queue_depth = queue_depth;
+	memcpy(stat_page->counters, stat_counters, sizeof(stat_counters));
+	memcpy(stat_page->last, stat_last, sizeof(stat_last));
+	stat_page->nmounts = 0;
+	stat_page->mounts_total = 0;
+}
+
+void stat_mount(const char *devfile, const char *mntfile,
+		dev_t devno, unsigned long long diskseq,
+		int mnt_id, void *arg)
+{
+	struct diskstat_mount *ent;
+
+	if (!stat_page || stat_page->mounts_total++ >= STAT_MAX_MOUNTS)
+		return;
+
+	ent = &stat_page->mounts[stat_page->nmounts++];
+	snprintf(ent->device, sizeof(ent->device), "%s", devfile);
+	snprintf(ent->point, sizeof(ent->point), "%s", mntfile);
+	ent->major = major(devno);
+	ent->minor = minor(devno);
+	ent->diskseq = diskseq;
+	ent->mnt_id = mnt_id;
+}
+
+void stat_end(void)
+{
+	if (!stat_page)
+		return;
+
+	stat_write_end(stat_page);
+}
+
+/*
+ * Take consistent copy of status page. Page stays mapped,
+ * so repeated snapshots cost no system calls. Gives up when
+ * page stays odd, i.e. writer died mid update.
+ */
+int stat_read(struct diskstat *snap)
+{
+	static struct diskstat *page;
+	struct stat st;
+	uint32_t seq;
+	int fd, tries = 0;
+
+	if (!page) {
+		fd = open(STAT_FILE, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return -1;
+		/* Short file would fault on access */
+		if (fstat(fd, &st) || st.st_size < sizeof(*page)) {
+			close(fd);
+			return -1;
+		}
+		page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (page == MAP_FAILED) {
+			page = NULL;
+			return -1;
+		}
+	}
+
+	do {
+		if (tries++ >= STAT_READ_RETRIES)
+			return -1;
+		seq = stat_seq_load(page);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(snap, page, sizeof(*snap));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (seq & 1 || seq != __atomic_load_n(&page->seq, __ATOMIC_RELAXED));
+
+	if (snap->magic != STAT_MAGIC || snap->version != STAT_VERSION ||
+	    snap->size != sizeof(*snap))
+		return -1;
+
+	return 0;
+}
+
+void stat_dump(FILE *fp, struct diskstat *snap)
+{
+	static const char *names[STAT_COUNTERS] = {
+		[STAT_EVENTS] = "events",
+		[STAT_MOUNTS] = "mounts",
+		[STAT_MOUNT_FAILS] = "mount_fails",
+		[STAT_UMOUNTS] = "umounts",
+		[STAT_UMOUNT_FAILS] = "umount_fails",
+	};
+	struct diskstat_mount *ent;
+	uint32_t i;
+
+	fprintf(fp, "pid\t\t%i\n", snap->pid);
+	fprintf(fp, "started\t\t%lld\n", (long long)snap->started);
+	fprintf(fp, "updated\t\t%lld\n", (long long)snap->updated);
+	fprintf(fp, "queue\t\t%u\n", snap->queue_depth);
+	for (i = 0; i < STAT_COUNTERS; i++)
+		fprintf(fp, "%s\t%s%llu\t%lld\n", names[i],
+			strlen(names[i]) < 8 ? "\t" : "",
+			(unsigned long long)snap->counters[i],
+			(long long)snap->last[i]);
+
+	fprintf(fp, "Mounts %u/%u:\n", snap->nmounts, snap->mounts_total);
+	for (i = 0; i < snap->nmounts && i < STAT_MAX_MOUNTS; i++) {
+		ent = &snap->mounts[i];
+		fprintf(fp, "%s\t\t%s\t\t%u:%u\t%llu\t%i\n", ent->device, ent->point,
+			ent->major, ent->minor,
+			(unsigned long long)ent->diskseq, ent->mnt_id);
+	}
+}
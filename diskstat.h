@@ -0,0 +1,64 @@
+#ifndef _DISKSTAT_H
+#define _DISKSTAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <sys/types.h>
+
+#define STAT_FILE "/dev/shm/diskmount.stat"
+#define STAT_MAGIC 0x54534d44
+#define STAT_VERSION 1
+#define STAT_MAX_MOUNTS 64
+
+#define STAT_EVENTS 0
+#define STAT_MOUNTS 1
+#define STAT_MOUNT_FAILS 2
+#define STAT_UMOUNTS 3
+#define STAT_UMOUNT_FAILS 4
+#define STAT_COUNTERS 5
+
+struct diskstat_mount {
+	char device[64];
+	char point[256];
+	uint32_t major;
+	uint32_t minor;
+	uint64_t diskseq;
+	int32_t mnt_id;
+	uint32_t pad;
+};
+
+/*
+ * Fixed layout page, written by daemon under seqlock:
+ * odd sequence means update in progress.
+ */
+struct diskstat {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t seq;
+	int32_t pid;
+	uint32_t queue_depth;
+	/* Wall clock seconds */
+	int64_t started;
+	int64_t updated;
+	int64_t last[STAT_COUNTERS];
+	uint64_t counters[STAT_COUNTERS];
+	/* Entries held in page and in mount tab */
+	uint32_t nmounts;
+	uint32_t mounts_total;
+	struct diskstat_mount mounts[STAT_MAX_MOUNTS];
+};
+
+int stat_open(void);
+void stat_close(void);
+void stat_count(int counter);
+void stat_begin(uint32_t queue_depth);
+void stat_mount(const char *devfile, const char *mntfile,
+		dev_t devno, unsigned long long diskseq,
+		int mnt_id, void *arg);
+void stat_end(void);
+int stat_read(struct diskstat *snap);
+void stat_dump(FILE *fp, struct diskstat *snap);
+
+#endif // _DISKSTAT_H
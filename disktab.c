@@ -1,54 +1,239 @@
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <mntent.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
 
 #include "list.h"
+#include "rcu.h"
 #include "util.h"
 #include "diskconf.h"
+#include "disktab.h"
+
+#define TAB_HASH_BITS 8
+#define TAB_HASH_SIZE (1 << TAB_HASH_BITS)
+#define TAB_HASH_MASK (TAB_HASH_SIZE - 1)
+
+/* listmount()/statmount() ABI (Linux 6.8+), not in libc headers yet */
+#ifndef SYS_statmount
+#define SYS_statmount 457
+#endif
+#ifndef SYS_listmount
+#define SYS_listmount 458
+#endif
+#define TAB_STATX_MNT_ID_UNIQUE 0x4000U
+#define TAB_SM_MNT_BASIC 0x02
+#define TAB_SM_MNT_POINT 0x10
+#define TAB_SM_SB_SOURCE 0x200
+#define TAB_LIST_BATCH 256
+/* Room for new mounts before growing seen mounts */
+#define TAB_SEEN_SPARE 16
+
+struct tab_mnt_req {
+	uint32_t size;
+	uint32_t spare;
+	uint64_t mnt_id;
+	uint64_t param;
+};
+
+struct tab_statmount {
+	uint32_t size;
+	uint32_t mnt_opts;
+	uint64_t mask;
+	uint32_t sb_dev_major;
+	uint32_t sb_dev_minor;
+	uint64_t sb_magic;
+	uint32_t sb_flags;
+	uint32_t fs_type;
+	uint64_t mnt_id;
+	uint64_t mnt_parent_id;
+	uint32_t mnt_id_old;
+	uint32_t mnt_parent_id_old;
+	uint64_t mnt_attr;
+	uint64_t mnt_propagation;
+	uint64_t mnt_peer_group;
+	uint64_t mnt_master;
+	uint64_t propagate_from;
+	uint32_t mnt_root;
+	uint32_t mnt_point;
+	uint64_t mnt_ns_id;
+	uint32_t fs_subtype;
+	uint32_t sb_source;
+	uint64_t spare[48];
+	char str[];
+};
+
+/* Mount seen by sync */
+struct tab_seen {
+	/* Unique mount ID, or mountinfo ID */
+	uint64_t key;
+	uint64_t parent;
+	/* Mountinfo line hash */
+	uint32_t hash;
+	int mnt_id;
+};
 
 struct diskent {
 	char *mount_device;
 	char *mount_point;
+	dev_t devno;
+	unsigned long long diskseq;
+	/* Kernel mount ID, zero until seen in mountinfo */
+	int mnt_id;
+	/* Last mountinfo pass which has seen entry */
+	unsigned int gen;
+	struct hlist_node dev_node;
+	struct hlist_node point_node;
+	struct hlist_node id_node;
 	struct list_head list;
 };
 
+/*
+ * Table is modified only by event loop; lookups may run from any
+ * thread and walk it under rcu_read_lock(). Removed entries are
+ * released by rcu_reclaim(), so strings returned by tab_find*()
+ * stay valid in event loop until its next reclaim pass.
+ */
 LLIST_HEAD(mount_tab);
+/* Device number -> mount and mount point -> device indexes */
+static struct hlist_head tab_dev_hash[TAB_HASH_SIZE];
+static struct hlist_head tab_point_hash[TAB_HASH_SIZE];
+/* Mount ID -> mount index, used by mountinfo sync */
+static struct hlist_head tab_id_hash[TAB_HASH_SIZE];
+/* Entries without known device number */
+static int tab_unkeyed;
+/* Mountinfo sync pass counter */
+static unsigned int tab_gen;
+/* Mounts seen by previous sync sorted by key, and by running one */
+static struct tab_seen *tab_seen;
+static size_t tab_nseen;
+static struct tab_seen *tab_next;
+static size_t tab_nnext, tab_max;
+/* Sync by mount IDs: -1 untried, 0 unsupported, 1 in use */
+static int tab_direct = -1;
 
-void tab_del(const char *devfile)
+static inline struct hlist_head *tab_dev_head(dev_t devno)
 {
-	struct diskent *tmp;
-	struct diskent *ent = NULL;
+	return &tab_dev_hash[hash_u64(devno) & TAB_HASH_MASK];
+}
 
-	list_for_each_entry(tmp, &mount_tab, list) {
-		ent = tmp;
-		if (!strcmp(tmp->mount_device, devfile))
-			break;
-		ent = NULL;
+static inline struct hlist_head *tab_point_head(const char *mntfile)
+{
+	return &tab_point_hash[hash_str(mntfile) & TAB_HASH_MASK];
+}
+
+static inline struct hlist_head *tab_id_head(int mnt_id)
+{
+	return &tab_id_hash[hash_u64(mnt_id) & TAB_HASH_MASK];
+}
+
+/*
+ * Device numbers are reused as soon as disk is gone, disk
+ * sequence number tells apart different disk incarnations.
+ * Unknown (zero) sequence on either side matches any.
+ */
+static int tab_match(struct diskent *ent, dev_t devno, unsigned long long diskseq)
+{
+	if (ent->devno != devno)
+		return 0;
+	if (diskseq && ent->diskseq && ent->diskseq != diskseq)
+		return 0;
+	return 1;
+}
+
+static struct diskent *tab_lookup(dev_t devno, unsigned long long diskseq,
+				  const char *devfile)
+{
+	struct diskent *ent;
+	struct hlist_node *pos;
+
+	if (devno) {
+		hlist_for_each_entry_rcu(ent, pos, tab_dev_head(devno), dev_node) {
+			if (tab_match(ent, devno, diskseq))
+				return ent;
+		}
+		if (!__atomic_load_n(&tab_unkeyed, __ATOMIC_RELAXED))
+			return NULL;
 	}
 
-	if (!ent)
-		return;
+	/* Device number is unknown, i.e. manually
+	 * triggered event, fall back to device name. */
+	if (!devfile)
+		return NULL;
+
+	list_for_each_entry_rcu(ent, &mount_tab, list) {
+		if (devno && ent->devno)
+			continue;
+		if (!strcmp(ent->mount_device, devfile))
+			return ent;
+	}
+
+	return NULL;
+}
+
+static void tab_free(void *ptr)
+{
+	struct diskent *ent = ptr;
 
-	list_del(&ent->list);
 	free(ent->mount_device);
 	free(ent->mount_point);
 	free(ent);
 }
 
-void tab_add(const char *devfile, const char *mntfile)
+static void tab_remove(struct diskent *ent)
+{
+	vinfo("Removed mount entry: '%s' -> '%s'", ent->mount_device, ent->mount_point);
+
+	if (!ent->devno)
+		__atomic_sub_fetch(&tab_unkeyed, 1, __ATOMIC_RELAXED);
+	list_del_rcu(&ent->list);
+	hlist_del_rcu(&ent->dev_node);
+	hlist_del_rcu(&ent->point_node);
+	if (!hlist_unhashed(&ent->id_node))
+		hlist_del_rcu(&ent->id_node);
+	call_rcu(ent, tab_free);
+}
+
+static void tab_set_id(struct diskent *ent, int mnt_id)
+{
+	ent->mnt_id = mnt_id;
+	hlist_add_head_rcu(&ent->id_node, tab_id_head(mnt_id));
+}
+
+void tab_del(dev_t devno, unsigned long long diskseq, const char *devfile)
+{
+	struct diskent *ent;
+
+	ent = tab_lookup(devno, diskseq, devfile);
+	if (!ent)
+		return;
+
+	tab_remove(ent);
+}
+
+static struct diskent *tab_insert(const char *devfile, const char *mntfile,
+				  dev_t devno, unsigned long long diskseq)
 {
 	struct diskent *def;
 
 	if (!strlen(devfile) || !strlen(mntfile)) {
 		vwarn("Skipped invalid mount entry: '%s' -> '%s'", devfile, mntfile);
-		return;
+		return NULL;
 	}
 
 	if (devfile[0] != '/') {
 		vinfo("Skipped incorrect mount entry: '%s' -> '%s'", devfile, mntfile);
-		return;
+		return NULL;
 	}
 
 	def = calloc(1, sizeof(*def));
@@ -57,24 +242,533 @@ void tab_add(const char *devfile, const char *mntfile)
 
 	def->mount_device = strdup(devfile);
 	def->mount_point = strdup(mntfile);
-	list_add_tail(&def->list, &mount_tab);
-	vinfo("Added mount entry: '%s' -> '%s'", devfile, mntfile);
+	def->devno = devno;
+	def->diskseq = diskseq;
+	if (!devno)
+		__atomic_add_fetch(&tab_unkeyed, 1, __ATOMIC_RELAXED);
+	list_add_tail_rcu(&def->list, &mount_tab);
+	hlist_add_head_rcu(&def->dev_node, tab_dev_head(devno));
+	hlist_add_head_rcu(&def->point_node, tab_point_head(mntfile));
+	def->gen = tab_gen;
+	vinfo("Added mount entry: '%s' -> '%s' (%u:%u, diskseq %llu)",
+	      devfile, mntfile, major(devno), minor(devno), diskseq);
+
+	return def;
 }
 
-void tab_load(void)
+void tab_add(const char *devfile, const char *mntfile,
+	     dev_t devno, unsigned long long diskseq)
 {
+	struct diskent *ent;
+	struct hlist_node *pos;
+
+	/* Mountinfo sync may have seen mount already */
+	hlist_for_each_entry(ent, pos, tab_point_head(mntfile), point_node) {
+		if (!strcmp(ent->mount_point, mntfile) &&
+		    !strcmp(ent->mount_device, devfile))
+			return;
+	}
+
+	/* Mount ID is picked up by next mountinfo sync */
+	tab_insert(devfile, mntfile, devno, diskseq);
+}
+
+static struct diskent *tab_lookup_id(int mnt_id)
+{
+	struct diskent *ent;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(ent, pos, tab_id_head(mnt_id), id_node) {
+		if (ent->mnt_id == mnt_id)
+			return ent;
+	}
+
+	return NULL;
+}
+
+static struct diskent *tab_lookup_point(const char *mntfile)
+{
+	struct diskent *ent;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(ent, pos, tab_point_head(mntfile), point_node) {
+		if (!ent->mnt_id && !strcmp(ent->mount_point, mntfile))
+			return ent;
+	}
+
+	return NULL;
+}
+
+/* Mountinfo escapes space, tab, newline and backslash as octal */
+static void tab_unescape(char *str)
+{
+	char *dst = str;
+
+	while (*str) {
+		if (str[0] == '\\' &&
+		    str[1] >= '0' && str[1] <= '3' &&
+		    str[2] >= '0' && str[2] <= '7' &&
+		    str[3] >= '0' && str[3] <= '7') {
+			*dst++ = (str[1] - '0') << 6 | (str[2] - '0') << 3 | (str[3] - '0');
+			str += 4;
+		} else {
+			*dst++ = *str++;
+		}
+	}
+	*dst = '\0';
+}
+
+/*
+ * Mountinfo line:
+ * 36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - ext3 /dev/root rw
+ * (1)(2)(3)   (4)   (5)         (6)        (7)    (8) (9)  (10)      (11)
+ */
+static int tab_parse_line(char *line, int *mnt_id, char **point, char **source)
+{
+	char *field, *save = NULL;
+	int i;
+
+	field = strtok_r(line, " \n", &save);
+	if (!field)
+		return -1;
+	*mnt_id = atoi(field);
+
+	/* Skip parent ID, device, root */
+	for (i = 0; i < 4; i++) {
+		field = strtok_r(NULL, " \n", &save);
+		if (!field)
+			return -1;
+	}
+	*point = field;
+
+	/* Optional fields end with separator */
+	do {
+		field = strtok_r(NULL, " \n", &save);
+		if (!field)
+			return -1;
+	} while (strcmp(field, "-"));
+
+	/* Skip file system type */
+	if (!strtok_r(NULL, " \n", &save))
+		return -1;
+	*source = strtok_r(NULL, " \n", &save);
+	if (!*source)
+		return -1;
+
+	tab_unescape(*point);
+	tab_unescape(*source);
+
+	return 0;
+}
+
+/*
+ * Entry for mount seen in mount table: known ID keeps its entry,
+ * own mounts without ID yet are matched by mount point and other
+ * configured ones are added.
+ */
+static void tab_sync_mount(int mnt_id, char *point, const char *source)
+{
+	struct diskent *ent;
+	struct stat st;
+	dev_t devno = 0;
+	unsigned long long diskseq = 0;
+
+	ent = tab_lookup_id(mnt_id);
+	if (ent) {
+		ent->gen = tab_gen;
+		return;
+	}
+
+	if (!conf_has_mount(point))
+		return;
+
+	ent = tab_lookup_point(point);
+	if (!ent) {
+		if (!stat(source, &st) && S_ISBLK(st.st_mode)) {
+			devno = st.st_rdev;
+			diskseq = get_disk_seq(major(devno), minor(devno));
+		}
+		ent = tab_insert(source, point, devno, diskseq);
+		if (!ent)
+			return;
+	}
+
+	ent->gen = tab_gen;
+	tab_set_id(ent, mnt_id);
+}
+
+static int tab_seen_cmp(const void *a, const void *b)
+{
+	const struct tab_seen *sa = a, *sb = b;
+
+	return (sa->key > sb->key) - (sa->key < sb->key);
+}
+
+static struct tab_seen *tab_seen_find(uint64_t key)
+{
+	struct tab_seen probe = { .key = key };
+
+	return bsearch(&probe, tab_seen, tab_nseen, sizeof(*tab_seen), tab_seen_cmp);
+}
+
+static struct tab_seen *tab_seen_add(uint64_t key, int mnt_id)
+{
+	struct tab_seen *seen;
+
+	if (tab_nnext == tab_max) {
+		tab_max *= 2;
+		tab_next = realloc(tab_next, tab_max * sizeof(*tab_next));
+		if (!tab_next)
+			die("malloc() failed");
+	}
+
+	seen = &tab_next[tab_nnext++];
+	memset(seen, 0, sizeof(*seen));
+	seen->key = key;
+	seen->mnt_id = mnt_id;
+
+	return seen;
+}
+
+/* Unchanged mount keeps its entry */
+static void tab_seen_keep(int mnt_id)
+{
+	struct diskent *ent;
+
+	ent = tab_lookup_id(mnt_id);
+	if (ent)
+		ent->gen = tab_gen;
+}
+
+static void tab_seen_begin(void)
+{
+	tab_max = tab_nseen + TAB_SEEN_SPARE;
+	tab_nnext = 0;
+	tab_next = malloc(tab_max * sizeof(*tab_next));
+	if (!tab_next)
+		die("malloc() failed");
+
+	tab_gen++;
+}
+
+static void tab_seen_abort(void)
+{
+	free(tab_next);
+	tab_next = NULL;
+}
+
+/* Entries of mounts which were not seen are dropped */
+static void tab_seen_end(void)
+{
+	struct diskent *ent, *tmp;
+
+	qsort(tab_next, tab_nnext, sizeof(*tab_next), tab_seen_cmp);
+	free(tab_seen);
+	tab_seen = tab_next;
+	tab_nseen = tab_nnext;
+	tab_next = NULL;
+
+	list_for_each_entry_safe(ent, tmp, &mount_tab, list) {
+		if (ent->gen == tab_gen)
+			continue;
+		vinfo("Mount '%s' -> '%s' is gone", ent->mount_device, ent->mount_point);
+		tab_remove(ent);
+	}
+}
+
+/* Only lines which changed since previous sync are parsed */
+static int tab_sync_mountinfo(void)
+{
+	struct tab_seen *seen, *prev;
+	char *line = NULL;
+	char *point, *source;
+	size_t size = 0;
+	ssize_t len;
 	FILE *fp;
-	struct mntent *ent;
+	int mnt_id;
 
-	fp = setmntent("/etc/mtab", "r");
+	fp = fopen("/proc/self/mountinfo", "re");
 	if (!fp)
-		fp = setmntent("/proc/mounts", "r");
-	if (!fp) {
-		warn("Cannot load mounts");
+		return -1;
+
+	tab_seen_begin();
+
+	while ((len = getline(&line, &size, fp)) > 0) {
+		mnt_id = atoi(line);
+		seen = tab_seen_add(mnt_id, mnt_id);
+		seen->hash = hash_buf(line, len);
+
+		prev = tab_seen_find(mnt_id);
+		if (prev && prev->hash == seen->hash) {
+			tab_seen_keep(mnt_id);
+			continue;
+		}
+
+		if (tab_parse_line(line, &mnt_id, &point, &source))
+			continue;
+		tab_sync_mount(mnt_id, point, source);
+	}
+	free(line);
+	fclose(fp);
+
+	tab_seen_end();
+
+	return 0;
+}
+
+/* Next sync examines every mount again, i.e. after config change */
+void tab_rescan(void)
+{
+	free(tab_seen);
+	tab_seen = NULL;
+	tab_nseen = 0;
+}
+
+static int tab_statmount(uint64_t mnt_id, struct tab_statmount *sm, size_t size)
+{
+	struct tab_mnt_req req = {
+		.size = sizeof(req),
+		.mnt_id = mnt_id,
+		.param = TAB_SM_MNT_BASIC | TAB_SM_MNT_POINT | TAB_SM_SB_SOURCE,
+	};
+
+	if (syscall(SYS_statmount, &req, sm, size, 0) < 0)
+		return -1;
+
+	/* Source is reported since Linux 6.14 */
+	if (!(sm->mask & TAB_SM_SB_SOURCE) || !(sm->mask & TAB_SM_MNT_POINT)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void tab_add_statmount(struct tab_statmount *sm)
+{
+	tab_sync_mount(sm->mnt_id_old, sm->str + sm->mnt_point,
+		       sm->str + sm->sb_source);
+}
+
+static union {
+	struct tab_statmount sm;
+	char buf[sizeof(struct tab_statmount) + 2 * PATH_MAX];
+} tab_sm;
+
+static int tab_probe_err;
+
+/* Look up mount sitting right on configured mount point */
+static void tab_probe_point(const char *point, void *arg)
+{
+	struct statx stx;
+
+	if (tab_probe_err)
+		return;
+
+	if (statx(AT_FDCWD, point, AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW,
+		  TAB_STATX_MNT_ID_UNIQUE, &stx))
+		return;
+
+	if (!(stx.stx_mask & TAB_STATX_MNT_ID_UNIQUE) ||
+	    !(stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT)) {
+		tab_probe_err = EOPNOTSUPP;
 		return;
 	}
 
-	vinfo("Loading mounts");
+	if (!(stx.stx_attributes & STATX_ATTR_MOUNT_ROOT))
+		return;
+
+	if (tab_statmount(stx.stx_mnt_id, &tab_sm.sm, sizeof(tab_sm))) {
+		tab_probe_err = errno;
+		return;
+	}
+
+	tab_add_statmount(&tab_sm.sm);
+}
+
+/*
+ * Mount known from previous sync reuses its parent and entry,
+ * only new mounts are queried. Returns 1 if mount is gone.
+ */
+static int tab_visit(uint64_t mnt_id, uint64_t *parent)
+{
+	struct tab_seen *seen, *prev;
+
+	prev = tab_seen_find(mnt_id);
+	if (prev) {
+		seen = tab_seen_add(mnt_id, prev->mnt_id);
+		seen->parent = *parent = prev->parent;
+		tab_seen_keep(prev->mnt_id);
+		return 0;
+	}
+
+	if (tab_statmount(mnt_id, &tab_sm.sm, sizeof(tab_sm)))
+		return errno == ENOENT ? 1 : -1;
+
+	seen = tab_seen_add(mnt_id, tab_sm.sm.mnt_id_old);
+	seen->parent = *parent = tab_sm.sm.mnt_parent_id;
+	tab_add_statmount(&tab_sm.sm);
+
+	return 0;
+}
+
+/*
+ * Walk mount tree by IDs. Older kernels list only direct
+ * children of a mount, newer ones whole subtree; descend
+ * only while listings hold nothing but direct children.
+ */
+static int tab_walk_mounts(void)
+{
+	struct tab_mnt_req req = { .size = sizeof(req) };
+	struct statx stx;
+	uint64_t *queue = NULL, *ids, parent;
+	size_t head = 0, tail = 0, size = 0;
+	long i, n;
+	int subtree = 0, ret = -1;
+
+	if (statx(AT_FDCWD, "/", 0, TAB_STATX_MNT_ID_UNIQUE, &stx) ||
+	    !(stx.stx_mask & TAB_STATX_MNT_ID_UNIQUE))
+		return -1;
+
+	ids = malloc(TAB_LIST_BATCH * sizeof(*ids));
+	if (!ids)
+		die("malloc() failed");
+
+	queue = malloc(sizeof(*queue));
+	if (!queue)
+		die("malloc() failed");
+	queue[tail++] = stx.stx_mnt_id;
+	size = 1;
+
+	if (tab_visit(stx.stx_mnt_id, &parent))
+		goto out;
+
+	while (head < tail) {
+		req.mnt_id = queue[head++];
+		req.param = 0;
+
+		do {
+			n = syscall(SYS_listmount, &req, ids, TAB_LIST_BATCH, 0);
+			if (n < 0)
+				goto out;
+
+			for (i = 0; i < n; i++) {
+				ret = tab_visit(ids[i], &parent);
+				/* Raced with unmount */
+				if (ret > 0)
+					continue;
+				if (ret < 0)
+					goto out;
+				if (parent != req.mnt_id)
+					subtree = 1;
+			}
+			ret = -1;
+
+			for (i = 0; i < n && !subtree; i++) {
+				if (tail == size) {
+					size *= 2;
+					queue = realloc(queue, size * sizeof(*queue));
+					if (!queue)
+						die("malloc() failed");
+				}
+				queue[tail++] = ids[i];
+			}
+
+			if (n)
+				req.param = ids[n - 1];
+		} while (n == TAB_LIST_BATCH);
+
+		if (subtree)
+			break;
+	}
+	ret = 0;
+out:
+	free(queue);
+	free(ids);
+
+	return ret;
+}
+
+/* Walk whole mount tree, querying only mounts new since previous sync */
+static int tab_sync_direct(void)
+{
+	tab_seen_begin();
+
+	if (tab_walk_mounts()) {
+		vdebug("Mount walk failed: %s", strerror(errno));
+		tab_seen_abort();
+		tab_direct = 0;
+		tab_rescan();
+		return -1;
+	}
+
+	tab_seen_end();
+	tab_direct = 1;
+
+	return 0;
+}
+
+/*
+ * Bring mount tab in line with kernel: entries are
+ * matched by mount ID, new mounts are added and ones
+ * which are gone are dropped. Only mounts changed since
+ * previous sync are looked into, so cost of a change
+ * does not follow total mount count.
+ */
+int tab_sync(void)
+{
+	if (tab_direct && !tab_sync_direct())
+		return 0;
+
+	return tab_sync_mountinfo();
+}
+
+/* Query mounts directly, without parsing mount tables */
+static int tab_load_direct(void)
+{
+	tab_probe_err = 0;
+
+	if (!conf_walk_points(tab_probe_point, NULL)) {
+		if (!tab_probe_err)
+			return 0;
+		vdebug("Mount point probe failed: %s", strerror(tab_probe_err));
+		tab_direct = 0;
+		return -1;
+	}
+
+	/* Mount points are templated, visit every mount */
+	return tab_sync_direct();
+}
+
+int tab_watch(void)
+{
+	int fd;
+
+	/* Mount namespace changes raise POLLPRI */
+	fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		warn("Cannot watch mount changes: %s", strerror(errno));
+		return -1;
+	}
+
+	vdebug("Watching mount changes, fd %i", fd);
+
+	return fd;
+}
+
+static int tab_load_mtab(void)
+{
+	FILE *fp;
+	struct mntent *ent;
+	struct stat st;
+	dev_t devno;
+	unsigned long long diskseq;
+
+	fp = setmntent("/etc/mtab", "r");
+	if (!fp)
+		fp = setmntent("/proc/mounts", "r");
+	if (!fp)
+		return -1;
 
 	while (NULL != (ent = getmntent(fp))) {
 		if (!conf_has_mount(ent->mnt_dir)) {
@@ -83,21 +777,112 @@ void tab_load(void)
 			continue;
 		}
 
-		tab_add(ent->mnt_fsname, ent->mnt_dir);
+		devno = 0;
+		diskseq = 0;
+		if (!stat(ent->mnt_fsname, &st) && S_ISBLK(st.st_mode)) {
+			devno = st.st_rdev;
+			diskseq = get_disk_seq(major(devno), minor(devno));
+		}
+
+		tab_add(ent->mnt_fsname, ent->mnt_dir, devno, diskseq);
 	}
 	endmntent(fp);
+
+	return 0;
 }
 
-char *tab_find(const char *devfile)
+void tab_load(void)
 {
 	struct diskent *ent;
+	const char *source;
+	uint64_t start;
+	int cnt = 0;
 
-	list_for_each_entry(ent, &mount_tab, list) {
-		if (!strcmp(ent->mount_device, devfile))
-			return ent->mount_point;
+	vinfo("Loading mounts");
+
+	start = mono_usec();
+	if (!tab_load_direct()) {
+		source = "statmount";
+	} else if (!tab_sync()) {
+		source = "mountinfo";
+	} else if (!tab_load_mtab()) {
+		source = "mtab";
+	} else {
+		warn("Cannot load mounts");
+		return;
 	}
 
-	return NULL;
+	list_for_each_entry(ent, &mount_tab, list)
+		cnt++;
+
+	info("Loaded %i mounts using %s in %llu us", cnt, source,
+	     (unsigned long long)(mono_usec() - start));
+}
+
+char *tab_find(dev_t devno, unsigned long long diskseq, const char *devfile)
+{
+	struct diskent *ent;
+	char *point = NULL;
+
+	rcu_read_lock();
+	ent = tab_lookup(devno, diskseq, devfile);
+	if (ent)
+		point = ent->mount_point;
+	rcu_read_unlock();
+
+	return point;
+}
+
+char *tab_find_point(const char *mntfile, dev_t *devno, unsigned long long *diskseq)
+{
+	struct diskent *ent;
+	struct hlist_node *pos;
+	char *device = NULL;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(ent, pos, tab_point_head(mntfile), point_node) {
+		if (strcmp(ent->mount_point, mntfile))
+			continue;
+		if (devno)
+			*devno = ent->devno;
+		if (diskseq)
+			*diskseq = ent->diskseq;
+		device = ent->mount_device;
+		break;
+	}
+	rcu_read_unlock();
+
+	return device;
+}
+
+void tab_walk(tab_walk_cb cb, void *arg)
+{
+	struct diskent *ent;
+
+	list_for_each_entry(ent, &mount_tab, list)
+		cb(ent->mount_device, ent->mount_point, ent->devno,
+		   ent->diskseq, ent->mnt_id, arg);
+}
+
+/* Drops all entries, i.e. partially restored state */
+void tab_reset(void)
+{
+	struct diskent *ent, *tmp;
+
+	list_for_each_entry_safe(ent, tmp, &mount_tab, list)
+		tab_remove(ent);
+	tab_rescan();
+}
+
+/* Re-create entry handed over by previous daemon instance */
+void tab_restore(const char *devfile, const char *mntfile,
+		 dev_t devno, unsigned long long diskseq, int mnt_id)
+{
+	struct diskent *ent;
+
+	ent = tab_insert(devfile, mntfile, devno, diskseq);
+	if (ent && mnt_id)
+		tab_set_id(ent, mnt_id);
 }
 
 void tab_dump(FILE *fp)
@@ -106,6 +891,10 @@ void tab_dump(FILE *fp)
 
 	fprintf(fp, "Mount cache:\n");
 
-	list_for_each_entry(ent, &mount_tab, list)
-		fprintf(fp, "%s\t\t%s\n", ent->mount_device, ent->mount_point);
+	rcu_read_lock();
+	list_for_each_entry_rcu(ent, &mount_tab, list)
+		fprintf(fp, "%s\t\t%s\t\t%u:%u\t%llu\t%i\n", ent->mount_device,
+			ent->mount_point, major(ent->devno), minor(ent->devno),
+			ent->diskseq, ent->mnt_id);
+	rcu_read_unlock();
 }
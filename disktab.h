@@ -1,10 +1,25 @@
 #ifndef _DISKTAB_H
 #define _DISKTAB_H
 
-void tab_del(const char *devfile);
-void tab_add(const char *devfile, const char *mntfile);
+#include <sys/types.h>
+
+typedef void (*tab_walk_cb)(const char *devfile, const char *mntfile,
+			    dev_t devno, unsigned long long diskseq,
+			    int mnt_id, void *arg);
+
+void tab_del(dev_t devno, unsigned long long diskseq, const char *devfile);
+void tab_add(const char *devfile, const char *mntfile,
+	     dev_t devno, unsigned long long diskseq);
 void tab_load(void);
-char *tab_find(const char *devpath);
+int tab_sync(void);
+void tab_rescan(void);
+int tab_watch(void);
+char *tab_find(dev_t devno, unsigned long long diskseq, const char *devfile);
+char *tab_find_point(const char *mntfile, dev_t *devno, unsigned long long *diskseq);
+void tab_walk(tab_walk_cb cb, void *arg);
+void tab_reset(void);
+void tab_restore(const char *devfile, const char *mntfile,
+		 dev_t devno, unsigned long long diskseq, int mnt_id);
 void tab_dump(FILE *fp);
 
 #endif // _DISKTAB_H
@@ -0,0 +1,231 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+
+#include "util.h"
+#include "list.h"
+#include "diskconf.h"
+#include "disktab.h"
+#include "diskmnt.h"
+#include "drain.h"
+
+struct drain;
+
+struct drain_ent {
+	struct drain *drain;
+	char *device;
+	char *point;
+	int detach;
+	/* Closest drained mount above */
+	struct drain_ent *parent;
+	/* Mounts below still to unmount */
+	int children;
+	int synced;
+	int done;
+	int ret;
+	int err;
+	uint64_t sync_usec;
+	uint64_t done_usec;
+	struct list_head list;
+};
+
+struct drain {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head ents;
+	uint64_t start;
+	int pending;
+};
+
+static void drain_add(const char *devfile, const char *mntfile,
+		      dev_t devno, unsigned long long diskseq,
+		      int mnt_id, void *arg)
+{
+	struct drain *drain = arg;
+	struct drain_ent *ent;
+
+	ent = calloc(1, sizeof(*ent));
+	if (!ent)
+		die("malloc() failed");
+
+	ent->drain = drain;
+	ent->device = strdup(devfile);
+	ent->point = strdup(mntfile);
+	if (!ent->device || !ent->point)
+		die("malloc() failed");
+	ent->detach = conf_point_detach(mntfile);
+
+	list_add_tail(&ent->list, &drain->ents);
+	drain->pending++;
+}
+
+static void drain_link(struct drain *drain)
+{
+	struct drain_ent *ent, *up;
+
+	list_for_each_entry(ent, &drain->ents, list) {
+		list_for_each_entry(up, &drain->ents, list) {
+			if (!path_under(ent->point, up->point))
+				continue;
+			if (!ent->parent || strlen(up->point) > strlen(ent->parent->point))
+				ent->parent = up;
+		}
+		if (ent->parent)
+			ent->parent->children++;
+	}
+}
+
+/* Called with lock held */
+static void drain_finish(struct drain_ent *ent, int ret, int err)
+{
+	struct drain *drain = ent->drain;
+
+	ent->ret = ret;
+	ent->err = err;
+	ent->done = 1;
+	ent->done_usec = mono_usec() - drain->start;
+	if (ent->parent)
+		ent->parent->children--;
+	drain->pending--;
+	pthread_cond_broadcast(&drain->cond);
+}
+
+static void *drain_run(void *arg)
+{
+	struct drain_ent *ent = arg;
+	struct drain *drain = ent->drain;
+	int fd, ret, err = 0;
+
+	fd = open(ent->point, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || syncfs(fd))
+		warn("Failed to sync '%s': %s", ent->point, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+
+	pthread_mutex_lock(&drain->lock);
+	ent->synced = 1;
+	ent->sync_usec = mono_usec() - drain->start;
+	/* Children unmount before parent */
+	while (ent->children)
+		pthread_cond_wait(&drain->cond, &drain->lock);
+	pthread_mutex_unlock(&drain->lock);
+
+	ret = perform_umount(ent->device, ent->point, ent->detach);
+	if (ret)
+		err = errno;
+
+	pthread_mutex_lock(&drain->lock);
+	drain_finish(ent, ret, err);
+	pthread_mutex_unlock(&drain->lock);
+
+	return NULL;
+}
+
+static void drain_free(struct drain *drain)
+{
+	struct drain_ent *ent, *tmp;
+
+	list_for_each_entry_safe(ent, tmp, &drain->ents, list) {
+		list_del(&ent->list);
+		free(ent->device);
+		free(ent->point);
+		free(ent);
+	}
+	pthread_cond_destroy(&drain->cond);
+	pthread_mutex_destroy(&drain->lock);
+	free(drain);
+}
+
+/*
+ * Syncs all managed mounts at once, then unmounts them children
+ * first, each mount on its own thread, so slow disk holds up only
+ * mounts above it. Returns number of mounts which missed deadline;
+ * their threads are left behind along with drain state.
+ */
+int drain_mounts(unsigned int timeout_ms)
+{
+	struct drain *drain;
+	struct drain_ent *ent;
+	pthread_condattr_t cattr;
+	pthread_attr_t attr;
+	pthread_t tid;
+	struct timespec ts;
+	uint64_t deadline;
+	int ret, missed = 0;
+
+	drain = calloc(1, sizeof(*drain));
+	if (!drain)
+		die("malloc() failed");
+
+	INIT_LIST_HEAD(&drain->ents);
+	pthread_mutex_init(&drain->lock, NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&drain->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	tab_walk(drain_add, drain);
+	if (!drain->pending) {
+		drain_free(drain);
+		return 0;
+	}
+	drain_link(drain);
+
+	info("Draining %i mounts, deadline %u ms", drain->pending, timeout_ms);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_mutex_lock(&drain->lock);
+	drain->start = mono_usec();
+	list_for_each_entry(ent, &drain->ents, list) {
+		ret = pthread_create(&tid, &attr, drain_run, ent);
+		if (ret) {
+			error("Failed to start drain of '%s': %s", ent->point, strerror(ret));
+			drain_finish(ent, -1, ret);
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	deadline = drain->start + timeout_ms * 1000ULL;
+	ts.tv_sec = deadline / 1000000;
+	ts.tv_nsec = deadline % 1000000 * 1000;
+	while (drain->pending) {
+		if (pthread_cond_timedwait(&drain->cond, &drain->lock, &ts) == ETIMEDOUT)
+			break;
+	}
+
+	list_for_each_entry(ent, &drain->ents, list) {
+		if (!ent->done) {
+			error("Drain of '%s' -> '%s' missed deadline while %s",
+			      ent->device, ent->point, !ent->synced ? "syncing" :
+			      ent->children ? "waiting for nested" : "unmounting");
+			missed++;
+		} else if (ent->ret) {
+			error("Failed to unmount '%s' from '%s': %u (%s)",
+			      ent->device, ent->point, ent->err, strerror(ent->err));
+		} else {
+			info("Drained '%s' -> '%s' in %llu ms, synced in %llu ms",
+			     ent->device, ent->point,
+			     (unsigned long long)ent->done_usec / 1000,
+			     (unsigned long long)ent->sync_usec / 1000);
+		}
+	}
+	pthread_mutex_unlock(&drain->lock);
+
+	info("Drain finished in %llu ms, %i mounts missed deadline",
+	     (unsigned long long)(mono_usec() - drain->start) / 1000, missed);
+
+	if (!missed)
+		drain_free(drain);
+
+	return missed;
+}
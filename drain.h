@@ -0,0 +1,6 @@
+#ifndef _DRAIN_H
+#define _DRAIN_H
+
+int drain_mounts(unsigned int timeout_ms);
+
+#endif // _DRAIN_H
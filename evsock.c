@@ -1,8 +1,14 @@
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -16,6 +22,23 @@
 #endif
 
 #define SOCKET_FILE RUN_PATH"diskmount.sock"
+#define SPOOL_DIR RUN_PATH"diskmount"
+#define SPOOL_FILE SPOOL_DIR"/spool"
+#define SPOOL_DRAIN SPOOL_DIR"/spool.drain"
+#define SPOOL_MAGIC 0x4c505344
+#define SPOOL_MAX_DATA 8192
+
+/*
+ * Spool record, written with single O_APPEND write so
+ * concurrent clients need no locking. Torn records left
+ * by crashed writers are caught by checksum.
+ */
+struct spool_rec {
+	uint32_t magic;
+	uint32_t length;
+	uint32_t checksum;
+	char data[];
+};
 
 int evsock_open(void)
 {
@@ -71,8 +94,11 @@ int evsock_connect(void)
 	set_nio(sock);
 	set_coe(sock);
 
-	if (connect(sock, (struct sockaddr *)&srv_addr, srv_len) < 0)
-		die("connect(%s) failed", SOCKET_FILE);
+	if (connect(sock, (struct sockaddr *)&srv_addr, srv_len) < 0) {
+		vwarn("connect(%s) failed: %s", SOCKET_FILE, strerror(errno));
+		close(sock);
+		return -1;
+	}
 
 	return sock;
 }
@@ -91,27 +117,22 @@ int evsock_read(int sock, char *buf, size_t *len)
 	memset(buf, 0, size);
 	*len = 0;
 
+	/* Datagram socket, every event part
+	 * is delivered as separate message. */
 	while (1) {
-		cnt = recv(sock, buf + *len, size - *len, 0);
+		cnt = recv(sock, buf, size, 0);
 		if (cnt < 0) {
 			if (errno == EINTR)
 				continue;
-			if (errno == EAGAIN)
-				break;
 			error("failed receive on socket %i, err: %s (%i)\n",
 			      sock, strerror(errno), errno);
 			return -1;
-		} else if (cnt == 0) {
-			if (*len != 0)
-				break;
-			debug("empty response on socket %i, closing\n", sock);
-			close(sock);
-			return -1;
 		}
-
-		*len += cnt;
+		break;
 	}
 
+	*len = cnt;
+
 	vdebug("recv data: socket %i, len %zu", sock, *len);
 
 	return 0;
@@ -150,6 +171,20 @@ int evsock_write(int sock, char *buf, size_t len)
 	return 0;
 }
 
+/* Values are not trusted to be terminated */
+static unsigned long long evev_num(struct evtlv *tlv)
+{
+	char num[24];
+	size_t len = tlv->length;
+
+	if (len >= sizeof(num))
+		len = sizeof(num) - 1;
+	memcpy(num, tlv->value, len);
+	num[len] = '\0';
+
+	return strtoull(num, NULL, 10);
+}
+
 int evev_parse(struct diskev *evt, char *data, int size)
 {
 	struct evtlv *tlv;
@@ -157,11 +192,15 @@ int evev_parse(struct diskev *evt, char *data, int size)
 
 	memset(evt, 0, sizeof(*evt));
 
-	while (seek < size) {
+	while (seek + (int)sizeof(*tlv) <= size) {
 		tlv = (struct evtlv *)data;
+		if (tlv->length < 0 || seek + (int)sizeof(*tlv) + tlv->length > size) {
+			vwarn("Truncated event IE type %i, length %i", tlv->type, tlv->length);
+			break;
+		}
 		seek += tlv->length + sizeof(*tlv);
 		data += tlv->length + sizeof(*tlv);
-		if (tlv->type == EVTYPE_DONE || tlv->length == 0 || seek > size)
+		if (tlv->type == EVTYPE_DONE || tlv->length == 0)
 			break;
 
 		if (tlv->type == EVTYPE_ACTION)
@@ -178,6 +217,32 @@ int evev_parse(struct diskev *evt, char *data, int size)
 			evt->fsuuid = strndup(tlv->value, tlv->length);
 		else if (tlv->type == EVTYPE_PARTUUID)
 			evt->partuuid = strndup(tlv->value, tlv->length);
+		else if (tlv->type == EVTYPE_FSVERSION)
+			evt->fsversion = strndup(tlv->value, tlv->length);
+		else if (tlv->type == EVTYPE_PARTNUM)
+			evt->partnum = strndup(tlv->value, tlv->length);
+		else if (tlv->type == EVTYPE_PARTTYPE)
+			evt->parttype = strndup(tlv->value, tlv->length);
+		else if (tlv->type == EVTYPE_PARTNAME)
+			evt->partname = strndup(tlv->value, tlv->length);
+		else if (tlv->type == EVTYPE_PARTDISK)
+			evt->partdisk = strndup(tlv->value, tlv->length);
+		else if (tlv->type == EVTYPE_PARTSCHEME)
+			evt->partscheme = strndup(tlv->value, tlv->length);
+		else if (tlv->type == EVTYPE_DEVPATH)
+			evt->devpath = strndup(tlv->value, tlv->length);
+		else if (tlv->type == EVTYPE_MAJOR)
+			evt->major = evev_num(tlv);
+		else if (tlv->type == EVTYPE_MINOR)
+			evt->minor = evev_num(tlv);
+		else if (tlv->type == EVTYPE_DISKSEQ)
+			evt->diskseq = evev_num(tlv);
+		else if (tlv->type == EVTYPE_SEQNUM)
+			evt->seqnum = evev_num(tlv);
+		else if (tlv->type == EVTYPE_PROBED)
+			evt->probed = evev_num(tlv);
+		else if (tlv->type == EVTYPE_MEDIA)
+			evt->media_change = evev_num(tlv);
 		else
 			vwarn("Unknown event IE type %u, length %u",
 			      tlv->type, tlv->length);
@@ -214,31 +279,186 @@ static int evev_build_part(char *data, int type, char *line)
 int evev_build(char *data, int size, struct diskev *evt)
 {
 	char *last = data + size;
+	char major[16], minor[16];
+	char diskseq[24], seqnum[24];
+	char probed[4], media[4];
+	struct {
+		int type;
+		char *line;
+	} parts[] = {
+		{ EVTYPE_ACTION, evt->action },
+		{ EVTYPE_DEVICE, evt->device },
+		{ EVTYPE_FS, evt->filesys },
+		{ EVTYPE_LABEL, evt->label },
+		{ EVTYPE_SERIAL, evt->serial },
+		{ EVTYPE_FSUUID, evt->fsuuid },
+		{ EVTYPE_PARTUUID, evt->partuuid },
+		{ EVTYPE_FSVERSION, evt->fsversion },
+		{ EVTYPE_PARTNUM, evt->partnum },
+		{ EVTYPE_PARTTYPE, evt->parttype },
+		{ EVTYPE_PARTNAME, evt->partname },
+		{ EVTYPE_PARTDISK, evt->partdisk },
+		{ EVTYPE_PARTSCHEME, evt->partscheme },
+		{ EVTYPE_DEVPATH, evt->devpath },
+		/* Minor 0 is valid, device number
+		 * presence is defined by major. */
+		{ EVTYPE_MAJOR, evt->major ? major : NULL },
+		{ EVTYPE_MINOR, evt->major ? minor : NULL },
+		{ EVTYPE_DISKSEQ, evt->diskseq ? diskseq : NULL },
+		{ EVTYPE_SEQNUM, evt->seqnum ? seqnum : NULL },
+		{ EVTYPE_PROBED, evt->probed ? probed : NULL },
+		{ EVTYPE_MEDIA, evt->media_change ? media : NULL },
+		{ EVTYPE_DONE, NULL },
+	};
+	int i;
+
+	sprintf(major, "%u", evt->major);
+	sprintf(minor, "%u", evt->minor);
+	sprintf(diskseq, "%llu", evt->diskseq);
+	sprintf(seqnum, "%llu", evt->seqnum);
+	sprintf(probed, "%u", evt->probed);
+	sprintf(media, "%u", evt->media_change);
+
+	for (i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+		if (parts[i].line &&
+		    last - data < sizeof(struct evtlv) + strlen(parts[i].line) + 1)
+			return 0;
+		data += evev_build_part(data, parts[i].type, parts[i].line);
+		if (data >= last)
+			return 0;
+	}
 
-	data += evev_build_part(data, EVTYPE_ACTION, evt->action);
-	if (data >= last)
-		return 0;
-	data += evev_build_part(data, EVTYPE_DEVICE, evt->device);
-	if (data >= last)
-		return 0;
-	data += evev_build_part(data, EVTYPE_FS, evt->filesys);
-	if (data >= last)
-		return 0;
-	data += evev_build_part(data, EVTYPE_LABEL, evt->label);
-	if (data >= last)
-		return 0;
-	data += evev_build_part(data, EVTYPE_SERIAL, evt->serial);
-	if (data >= last)
-		return 0;
-	data += evev_build_part(data, EVTYPE_FSUUID, evt->fsuuid);
-	if (data >= last)
-		return 0;
-	data += evev_build_part(data, EVTYPE_PARTUUID, evt->partuuid);
-	if (data >= last)
-		return 0;
-	data += evev_build_part(data, EVTYPE_DONE, NULL);
-	if (data >= last)
+	return size - (last - data);
+}
+
+/*
+ * Opens spool locked for append. Daemon renames spool away
+ * under the lock, so writer which got it only after rename
+ * starts over with fresh spool instead of appending to one
+ * already drained.
+ */
+static int spool_lock(void)
+{
+	struct stat fst, pst;
+	int fd;
+
+	while (1) {
+		fd = open(SPOOL_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | O_NOFOLLOW,
+			  S_IRUSR | S_IWUSR);
+		if (fd < 0) {
+			error("open(%s) failed: %s", SPOOL_FILE, strerror(errno));
+			return -1;
+		}
+
+		if (flock(fd, LOCK_EX)) {
+			error("flock(%s) failed: %s", SPOOL_FILE, strerror(errno));
+			close(fd);
+			return -1;
+		}
+
+		if (!fstat(fd, &fst) && !stat(SPOOL_FILE, &pst) &&
+		    fst.st_dev == pst.st_dev && fst.st_ino == pst.st_ino)
+			return fd;
+
+		close(fd);
+	}
+}
+
+int evsock_spool(char *buf, size_t len)
+{
+	struct spool_rec *rec;
+	ssize_t cnt;
+	int fd;
+
+	if (len > SPOOL_MAX_DATA)
+		return -1;
+
+	if (mkdir(SPOOL_DIR, S_IRWXU) && errno != EEXIST) {
+		error("mkdir(%s) failed: %s", SPOOL_DIR, strerror(errno));
+		return -1;
+	}
+
+	fd = spool_lock();
+	if (fd < 0)
+		return -1;
+
+	rec = malloc(sizeof(*rec) + len);
+	if (!rec)
+		die("malloc() failed");
+
+	rec->magic = SPOOL_MAGIC;
+	rec->length = len;
+	rec->checksum = hash_buf(buf, len);
+	memcpy(rec->data, buf, len);
+
+	cnt = write(fd, rec, sizeof(*rec) + len);
+	free(rec);
+	/* Drops the lock */
+	close(fd);
+
+	if (cnt != sizeof(*rec) + len) {
+		error("write(%s) failed: %s", SPOOL_FILE, strerror(errno));
+		return -1;
+	}
+
+	vdebug("Spooled event, size %zu", len);
+
+	return 0;
+}
+
+/*
+ * Called at start and then periodically, as clients which
+ * raced daemon start may still spool after first drain.
+ */
+int evsock_drain(spool_cb cb, void *arg)
+{
+	struct spool_rec rec;
+	char *buf;
+	FILE *fp;
+	int fd, cnt = 0;
+
+	fd = open(SPOOL_FILE, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			warn("open(%s) failed: %s", SPOOL_FILE, strerror(errno));
 		return 0;
+	}
 
-	return size - (last - data);
+	/* Writers holding lock finish their record, ones
+	 * waiting for it see spool gone and start over. */
+	if (flock(fd, LOCK_EX) || rename(SPOOL_FILE, SPOOL_DRAIN)) {
+		warn("Cannot take spool '%s': %s", SPOOL_FILE, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	fp = fdopen(fd, "r");
+	if (!fp) {
+		warn("Cannot open spool '%s'", SPOOL_DRAIN);
+		close(fd);
+		return -1;
+	}
+
+	buf = malloc(SPOOL_MAX_DATA);
+	if (!buf)
+		die("malloc() failed");
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if (rec.magic != SPOOL_MAGIC || rec.length > SPOOL_MAX_DATA ||
+		    fread(buf, rec.length, 1, fp) != 1 ||
+		    hash_buf(buf, rec.length) != rec.checksum) {
+			warn("Corrupted spool record, dropped rest of spool");
+			break;
+		}
+		cb(buf, rec.length, arg);
+		cnt++;
+	}
+
+	free(buf);
+	unlink(SPOOL_DRAIN);
+	fclose(fp);
+
+	vinfo("Drained %i spooled events", cnt);
+
+	return cnt;
 }
@@ -7,6 +7,12 @@
 #define EVHEAD_MAGIC 0
 #endif
 
+/* Wire format version, mixed into sent magic so
+ * client and daemon of different format do not
+ * misread each other. Version 1 sent bare magic. */
+#define EVHEAD_VERSION 2
+#define EVHEAD_WORD ((int)((unsigned int)EVHEAD_MAGIC ^ (EVHEAD_VERSION << 24)))
+
 #define EVTYPE_GROUP 1
 #define EVTYPE_DONE 2
 #define EVTYPE_ACTION 3
@@ -16,6 +22,19 @@
 #define EVTYPE_SERIAL 7
 #define EVTYPE_FSUUID 8
 #define EVTYPE_PARTUUID 9
+#define EVTYPE_FSVERSION 10
+#define EVTYPE_PARTNUM 11
+#define EVTYPE_PARTTYPE 12
+#define EVTYPE_PARTNAME 13
+#define EVTYPE_PARTDISK 14
+#define EVTYPE_PARTSCHEME 15
+#define EVTYPE_DEVPATH 16
+#define EVTYPE_MAJOR 17
+#define EVTYPE_MINOR 18
+#define EVTYPE_DISKSEQ 19
+#define EVTYPE_SEQNUM 20
+#define EVTYPE_PROBED 21
+#define EVTYPE_MEDIA 22
 
 struct evtlv {
 	short type;
@@ -23,12 +42,17 @@ struct evtlv {
 	char value[];
 };
 
+/* Spooled datagram, same format as sent to socket */
+typedef void (*spool_cb)(char *buf, size_t len, void *arg);
+
 int evsock_open(void);
 void evsock_close(int sock);
 int evsock_connect(void);
 void evsock_disconnect(int sock);
 int evsock_read(int sock, char *buf, size_t *len);
 int evsock_write(int sock, char *buf, size_t len);
+int evsock_spool(char *buf, size_t len);
+int evsock_drain(spool_cb cb, void *arg);
 int evev_parse(struct diskev *evt, char *data, int size);
 int evev_build(char *data, int size, struct diskev *evt);
 
@@ -0,0 +1,298 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "util.h"
+#include "diskev.h"
+#include "disktab.h"
+#include "evsock.h"
+#include "handoff.h"
+
+#define HANDOFF_MAGIC 0x48444d44
+#define HANDOFF_VERSION 2
+
+#define HANDOFF_EVENT 1
+#define HANDOFF_MOUNT 2
+#define HANDOFF_END 3
+
+/*
+ * State image: header followed by event and
+ * mount records, terminated by end record.
+ */
+/* Keep sockets first, older heads still hand them over */
+struct handoff_head {
+	uint32_t magic;
+	uint32_t version;
+	int32_t nlsock;
+	int32_t evsock;
+	int32_t kern_feed;
+};
+
+struct handoff_rec {
+	uint32_t type;
+	uint32_t length;
+};
+
+struct handoff_event {
+	/* Remaining schedule delay, ms */
+	int64_t delay;
+	char data[];
+};
+
+struct handoff_mount {
+	uint64_t devno;
+	uint64_t diskseq;
+	int32_t mnt_id;
+	/* Device and mount point strings */
+	uint32_t device_len;
+	char data[];
+};
+
+static void handoff_put(FILE *fp, uint32_t type, const void *data, uint32_t len)
+{
+	struct handoff_rec rec = { .type = type, .length = len };
+
+	fwrite(&rec, sizeof(rec), 1, fp);
+	if (len)
+		fwrite(data, len, 1, fp);
+}
+
+static void handoff_put_event(struct diskev *evt, void *arg)
+{
+	FILE *fp = arg;
+	char buf[4096];
+	struct handoff_event *he = (struct handoff_event *)buf;
+	int len;
+
+	he->delay = (int64_t)evt->ts - (int64_t)(mono_usec() / 1000);
+	len = evev_build(he->data, sizeof(buf) - sizeof(*he), evt);
+	if (!len) {
+		warn("Cannot hand over event '%s'", evt->device);
+		return;
+	}
+
+	handoff_put(fp, HANDOFF_EVENT, he, sizeof(*he) + len);
+}
+
+static void handoff_put_mount(const char *devfile, const char *mntfile,
+			      dev_t devno, unsigned long long diskseq,
+			      int mnt_id, void *arg)
+{
+	FILE *fp = arg;
+	struct handoff_mount *hm;
+	size_t dlen = strlen(devfile) + 1;
+	size_t mlen = strlen(mntfile) + 1;
+
+	hm = malloc(sizeof(*hm) + dlen + mlen);
+	if (!hm)
+		die("malloc() failed");
+
+	hm->devno = devno;
+	hm->diskseq = diskseq;
+	hm->mnt_id = mnt_id;
+	hm->device_len = dlen;
+	memcpy(hm->data, devfile, dlen);
+	memcpy(hm->data + dlen, mntfile, mlen);
+
+	handoff_put(fp, HANDOFF_MOUNT, hm, sizeof(*hm) + dlen + mlen);
+	free(hm);
+}
+
+static void handoff_coe(struct handoff *ho, int on)
+{
+	int fds[] = { ho->nlsock, ho->evsock };
+	int i, flags;
+
+	for (i = 0; i < 2; i++) {
+		flags = fcntl(fds[i], F_GETFD);
+		if (flags < 0)
+			continue;
+		fcntl(fds[i], F_SETFD, on ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC);
+	}
+}
+
+/*
+ * Serialize pending events and mount tab into memfd
+ * and exec new binary keeping event sockets open.
+ * Returns only on failure, running state is intact.
+ */
+int handoff_exec(const char *exe, char *argv[], struct handoff *ho)
+{
+	struct handoff_head head = {
+		.magic = HANDOFF_MAGIC,
+		.version = HANDOFF_VERSION,
+		.nlsock = ho->nlsock,
+		.evsock = ho->evsock,
+		.kern_feed = ho->kern_feed,
+	};
+	char env[16];
+	FILE *fp;
+	int fd;
+
+	fd = memfd_create("diskmountd-handoff", 0);
+	if (fd < 0) {
+		error("Cannot create handoff memfd: %s", strerror(errno));
+		return -1;
+	}
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		return -1;
+	}
+
+	fwrite(&head, sizeof(head), 1, fp);
+	ev_walk(handoff_put_event, fp);
+	tab_walk(handoff_put_mount, fp);
+	handoff_put(fp, HANDOFF_END, NULL, 0);
+
+	if (fflush(fp) || ferror(fp)) {
+		error("Cannot write handoff state: %s", strerror(errno));
+		fclose(fp);
+		return -1;
+	}
+
+	snprintf(env, sizeof(env), "%i", fd);
+	setenv(HANDOFF_ENV, env, 1);
+	handoff_coe(ho, 0);
+
+	info("Handing over to '%s', state fd %i", exe, fd);
+	/* Buffered log output is lost on exec */
+	fflush(NULL);
+	execv(exe, argv);
+
+	error("Failed to exec '%s': %s", exe, strerror(errno));
+	handoff_coe(ho, 1);
+	unsetenv(HANDOFF_ENV);
+	fclose(fp);
+
+	return -1;
+}
+
+static int handoff_read(FILE *fp, struct handoff *ho)
+{
+	struct handoff_head head;
+	struct handoff_rec rec;
+	struct handoff_event *he;
+	struct handoff_mount *hm;
+	struct diskev evt;
+	char *data = NULL;
+	int events = 0, mounts = 0;
+
+	if (fread(&head, sizeof(head), 1, fp) != 1 || head.magic != HANDOFF_MAGIC)
+		return -1;
+
+	/* Sockets are inherited whatever the version, close them */
+	if (head.version != HANDOFF_VERSION) {
+		ho->nlsock = head.nlsock;
+		ho->evsock = head.evsock;
+		return -1;
+	}
+
+	ho->nlsock = head.nlsock;
+	ho->evsock = head.evsock;
+	ho->kern_feed = head.kern_feed;
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if (rec.type == HANDOFF_END) {
+			free(data);
+			info("Taken over %i events, %i mounts", events, mounts);
+			return 0;
+		}
+
+		data = realloc(data, rec.length + 1);
+		if (!data)
+			die("malloc() failed");
+		if (rec.length && fread(data, rec.length, 1, fp) != 1)
+			break;
+		data[rec.length] = '\0';
+
+		if (rec.type == HANDOFF_EVENT && rec.length >= sizeof(*he)) {
+			he = (struct handoff_event *)data;
+			if (evev_parse(&evt, he->data, rec.length - sizeof(*he)))
+				continue;
+			ev_identify(&evt);
+			ev_insert(&evt, he->delay > 0 ? he->delay : 0);
+			events++;
+		} else if (rec.type == HANDOFF_MOUNT && rec.length > sizeof(*hm)) {
+			hm = (struct handoff_mount *)data;
+			if (hm->device_len >= rec.length - sizeof(*hm))
+				continue;
+			tab_restore(hm->data, hm->data + hm->device_len,
+				    hm->devno, hm->diskseq, hm->mnt_id);
+			mounts++;
+		}
+	}
+
+	free(data);
+
+	return -1;
+}
+
+/* Undo partial pick up before cold start */
+static void handoff_drop(struct handoff *ho)
+{
+	if (ho->nlsock >= 0)
+		close(ho->nlsock);
+	if (ho->evsock >= 0)
+		close(ho->evsock);
+	ho->nlsock = -1;
+	ho->evsock = -1;
+
+	ev_flush();
+	tab_reset();
+}
+
+/*
+ * Pick up state left by previous instance. Returns
+ * 1 when not started by handoff, -1 on broken state;
+ * then inherited sockets are closed and restored
+ * events and mounts dropped.
+ */
+int handoff_load(struct handoff *ho)
+{
+	const char *env;
+	FILE *fp;
+	int fd, ret;
+
+	env = getenv(HANDOFF_ENV);
+	if (!env)
+		return 1;
+
+	fd = atoi(env);
+	unsetenv(HANDOFF_ENV);
+	ho->nlsock = -1;
+	ho->evsock = -1;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		error("Invalid handoff state fd %i", fd);
+		return -1;
+	}
+
+	fp = fdopen(fd, "r");
+	if (!fp) {
+		close(fd);
+		return -1;
+	}
+
+	ret = handoff_read(fp, ho);
+	fclose(fp);
+	if (ret) {
+		error("Broken handoff state");
+		handoff_drop(ho);
+		return -1;
+	}
+
+	set_coe(ho->nlsock);
+	set_coe(ho->evsock);
+
+	return 0;
+}
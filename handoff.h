@@ -0,0 +1,16 @@
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+/* Carries handoff memfd number across exec */
+#define HANDOFF_ENV "DISKMOUNTD_HANDOFF"
+
+struct handoff {
+	int nlsock;
+	int evsock;
+	int kern_feed;
+};
+
+int handoff_exec(const char *exe, char *argv[], struct handoff *ho);
+int handoff_load(struct handoff *ho);
+
+#endif // _HANDOFF_H
@@ -7,7 +7,7 @@
 
 static inline void prefetch(const void *x) { }
 static inline void prefetchw(const void *x) { }
-static inline void smp_wmb(void) { }
+static inline void smp_wmb(void) { __atomic_thread_fence(__ATOMIC_RELEASE); }
 
 /**
  * container_of - cast a member of a structure out to the containing structure
@@ -106,50 +106,6 @@ int nlsock_recv(int sock, char *buf, size_t len)
 	return size;
 }
 
-static int nlev_update_part(struct diskev *evt, char *line)
-{
-	char *pos;
-
-	vdebug("Processing ENV line: '%s'", line);
-
-	pos = strchr(line, '=');
-	if (!pos) {
-		vwarn("Anomalous EVN parameter: '%s'", line);
-		return -1;
-	}
-	*pos = '\0';
-	pos++;
-
-	if (!strcmp(line, "ACTION")) {
-		evt->action = strdup(pos);
-	} else if (!strcmp(line, "SUBSYSTEM")) {
-		evt->subsys = strdup(pos);
-	} else if (!strcmp(line, "DEVTYPE")) {
-		evt->type = strdup(pos);
-	} else if (!strcmp(line, "DEVNAME")) {
-		if (strncmp(pos, "/dev", 4))
-			evt->device = strfdup("/dev/%s", pos);
-		else
-			evt->device = strdup(pos);
-	} else if (!strcmp(line, "ID_FS_TYPE")) {
-		evt->filesys = strdup(pos);
-	} else if (!strcmp(line, "ID_SERIAL_SHORT")) {
-		evt->serial = strdup(pos);
-	} else if (!strcmp(line, "ID_FS_LABEL")) {
-		evt->label = strdup(pos);
-	} else if (!strcmp(line, "ID_FS_UUID")) {
-		evt->fsuuid = strdup(pos);
-	} else if (!strcmp(line, "ID_PART_ENTRY_UUID")) {
-		evt->partuuid = strdup(pos);
-	} else {
-		return 1;
-	}
-
-	vinfo("Included ENV param: '%s' = '%s'", line, pos);
-
-	return 0;
-}
-
 int nlev_parse(struct diskev *evt, char *data, int size)
 {
 	char *cur, *end;
@@ -165,7 +121,7 @@ int nlev_parse(struct diskev *evt, char *data, int size)
 		if (cnt <= 0)
 			break;
 
-		nlev_update_part(evt, cur);
+		ev_update(evt, cur);
 		cur += cnt + 1;
 		prc += cnt + 1;
 		vdebug("Processed NL param, size %u, progress %u/%u", cnt, prc, size);
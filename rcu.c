@@ -0,0 +1,127 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "list.h"
+#include "util.h"
+#include "rcu.h"
+
+struct rcu_slot {
+	/* Observed epoch, zero when not reading */
+	uint64_t epoch;
+	int used;
+} __attribute__((aligned(64)));
+
+struct rcu_item {
+	void *ptr;
+	rcu_cb fn;
+	uint64_t epoch;
+	struct list_head list;
+};
+
+static uint64_t rcu_epoch = 1;
+static struct rcu_slot rcu_slots[RCU_MAX_THREADS];
+static __thread int rcu_self = -1;
+static __thread int rcu_nest;
+
+/* Writer side only */
+LLIST_HEAD(rcu_retired);
+
+static int rcu_register(void)
+{
+	int i, used;
+
+	for (i = 0; i < RCU_MAX_THREADS; i++) {
+		used = 0;
+		if (__atomic_compare_exchange_n(&rcu_slots[i].used, &used, 1, 0,
+						__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return i;
+	}
+
+	die("Too many RCU reader threads");
+}
+
+void rcu_read_lock(void)
+{
+	struct rcu_slot *slot;
+
+	if (rcu_nest++)
+		return;
+
+	if (rcu_self < 0)
+		rcu_self = rcu_register();
+
+	slot = &rcu_slots[rcu_self];
+	__atomic_store_n(&slot->epoch, __atomic_load_n(&rcu_epoch, __ATOMIC_ACQUIRE),
+			 __ATOMIC_SEQ_CST);
+	/* Epoch must be visible before protected loads */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void rcu_read_unlock(void)
+{
+	if (--rcu_nest)
+		return;
+
+	__atomic_store_n(&rcu_slots[rcu_self].epoch, 0, __ATOMIC_RELEASE);
+}
+
+void rcu_unregister_thread(void)
+{
+	if (rcu_self < 0)
+		return;
+
+	__atomic_store_n(&rcu_slots[rcu_self].epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&rcu_slots[rcu_self].used, 0, __ATOMIC_RELEASE);
+	rcu_self = -1;
+	rcu_nest = 0;
+}
+
+void call_rcu(void *ptr, rcu_cb fn)
+{
+	struct rcu_item *item;
+
+	item = malloc(sizeof(*item));
+	if (!item)
+		die("malloc() failed");
+
+	/* Object was unpublished before retire epoch,
+	 * readers entering later epochs cannot see it. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	item->ptr = ptr;
+	item->fn = fn;
+	item->epoch = __atomic_fetch_add(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+	list_add_tail(&item->list, &rcu_retired);
+}
+
+int rcu_reclaim(void)
+{
+	struct rcu_item *item, *tmp;
+	uint64_t epoch, oldest = UINT64_MAX;
+	int i, cnt = 0;
+
+	if (list_empty(&rcu_retired))
+		return 0;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < RCU_MAX_THREADS; i++) {
+		epoch = __atomic_load_n(&rcu_slots[i].epoch, __ATOMIC_ACQUIRE);
+		if (epoch && epoch < oldest)
+			oldest = epoch;
+	}
+
+	list_for_each_entry_safe(item, tmp, &rcu_retired, list) {
+		/* Reader of retire epoch may still hold it */
+		if (item->epoch >= oldest)
+			break;
+		list_del(&item->list);
+		item->fn(item->ptr);
+		free(item);
+		cnt++;
+	}
+
+	if (cnt)
+		vdebug("Reclaimed %i RCU objects", cnt);
+
+	return cnt;
+}
@@ -0,0 +1,27 @@
+#ifndef _RCU_H
+#define _RCU_H
+
+/*
+ * Minimal userspace RCU with epoch based reclamation.
+ *
+ * Readers never block: rcu_read_lock() only publishes global epoch
+ * observed by thread. Writers (serialized by event loop) unpublish
+ * objects and pass them to call_rcu(); objects are released by
+ * rcu_reclaim() once every reader has left older epochs.
+ */
+
+/* Reader slots, dies when more threads read */
+#define RCU_MAX_THREADS 64
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+typedef void (*rcu_cb)(void *ptr);
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void rcu_unregister_thread(void);
+void call_rcu(void *ptr, rcu_cb fn);
+int rcu_reclaim(void);
+
+#endif // _RCU_H
@@ -0,0 +1,289 @@
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mount.h>
+#include <sys/sysmacros.h>
+
+#include "../util.h"
+#include "../rcu.h"
+#include "../diskev.h"
+#include "../diskconf.h"
+#include "../disktab.h"
+
+/*
+ * Readers walk published snapshot while writer keeps swapping
+ * it, as event loop does with config on reload. Every snapshot
+ * is self consistent and poisoned before free, so reader seeing
+ * mixed generations or released memory reports torn state.
+ * Same readers look up config and mount table while writer
+ * reloads config and adds and removes mount entries.
+ */
+
+#define STRESS_READERS 8
+#define STRESS_SWAPS 20000
+#define STRESS_RULES 64
+#define STRESS_POISON 0xa5
+#define STRESS_TAB 64
+#define STRESS_MAJOR 250
+#define STRESS_RELOAD 16
+
+struct snap_rule {
+	uint64_t gen;
+	uint32_t point;
+	uint32_t opts;
+};
+
+struct snap {
+	uint64_t gen;
+	uint32_t nrules;
+	struct snap_rule *rules;
+	char *strs;
+	uint64_t check;
+};
+
+static struct snap *snap_cur;
+static int stop;
+static unsigned long torn;
+/* Test config is shadowed by system one */
+static int conf_foreign;
+
+static struct snap *snap_new(uint64_t gen)
+{
+	struct snap *s;
+	uint32_t i;
+
+	s = malloc(sizeof(*s));
+	if (!s)
+		die("malloc() failed");
+
+	s->gen = gen;
+	s->nrules = STRESS_RULES;
+	s->rules = malloc(sizeof(*s->rules) * s->nrules);
+	s->strs = malloc(s->nrules * 2 * 32);
+	if (!s->rules || !s->strs)
+		die("malloc() failed");
+
+	for (i = 0; i < s->nrules; i++) {
+		s->rules[i].gen = gen;
+		s->rules[i].point = i * 64;
+		s->rules[i].opts = i * 64 + 32;
+		snprintf(s->strs + s->rules[i].point, 32, "/mnt/%llu", (unsigned long long)gen);
+		snprintf(s->strs + s->rules[i].opts, 32, "x-gen=%llu", (unsigned long long)gen);
+	}
+	s->check = ~gen;
+
+	return s;
+}
+
+static void snap_free(void *ptr)
+{
+	struct snap *s = ptr;
+
+	memset(s->strs, STRESS_POISON, s->nrules * 2 * 32);
+	memset(s->rules, STRESS_POISON, sizeof(*s->rules) * s->nrules);
+	free(s->strs);
+	free(s->rules);
+	memset(s, STRESS_POISON, sizeof(*s));
+	free(s);
+}
+
+static int snap_check(struct snap *s)
+{
+	char buf[32];
+	uint32_t i;
+
+	if (s->check != ~s->gen || s->nrules != STRESS_RULES)
+		return 1;
+
+	for (i = 0; i < s->nrules; i++) {
+		if (s->rules[i].gen != s->gen)
+			return 1;
+		snprintf(buf, sizeof(buf), "/mnt/%llu", (unsigned long long)s->gen);
+		if (strcmp(s->strs + s->rules[i].point, buf))
+			return 1;
+		snprintf(buf, sizeof(buf), "x-gen=%llu", (unsigned long long)s->gen);
+		if (strcmp(s->strs + s->rules[i].opts, buf))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Even generations mount read-only on /mnt/even, odd ones on /mnt/odd */
+static void conf_write(uint64_t gen)
+{
+	const char *name = gen & 1 ? "odd" : "even";
+	FILE *fp;
+	int i;
+
+	fp = fopen("diskmount.conf", "we");
+	if (!fp)
+		die("Cannot write test config");
+
+	fprintf(fp, "DEV=/dev/sdb1\t\t/mnt/%s\t\text4\t%s\n", name, gen & 1 ? "rw" : "ro");
+	for (i = 0; i < STRESS_RULES; i++)
+		fprintf(fp, "DEV=/dev/sdx%i\t\t/mnt/%s/%i\n", i, name, i);
+	fprintf(fp, "DEV=/dev/sdz*\t\t/mnt/%s/%%dev%%\n", name);
+	fclose(fp);
+}
+
+static int conf_check(void)
+{
+	struct diskmatch match;
+	struct diskev evt;
+	int ro;
+
+	memset(&evt, 0, sizeof(evt));
+	evt.device = "/dev/sdb1";
+	if (conf_find(&evt, &match))
+		return !conf_foreign;
+	if (conf_foreign)
+		return 0;
+
+	ro = !!(match.flags_set & MS_RDONLY);
+	if (strcmp(match.point, ro ? "/mnt/even" : "/mnt/odd"))
+		return 1;
+	if (!match.fs || strcmp(match.fs, "ext4"))
+		return 1;
+
+	/* Pattern rule expands template */
+	evt.device = "/dev/sdz3";
+	if (conf_find(&evt, &match))
+		return 1;
+
+	return strcmp(match.point, "/mnt/even/sdz3") && strcmp(match.point, "/mnt/odd/sdz3");
+}
+
+static void tab_entry(unsigned int num, char *dev, char *point, size_t size)
+{
+	snprintf(dev, size, "/dev/stress%u", num);
+	snprintf(point, size, "/mnt/tab/%u", num);
+}
+
+static int tab_check(unsigned int num)
+{
+	char dev[32], point[32];
+	char *found;
+	int ret = 0;
+
+	tab_entry(num, dev, point, sizeof(dev));
+
+	/* Returned point is valid only inside read section */
+	rcu_read_lock();
+	found = tab_find(makedev(STRESS_MAJOR, num), 0, dev);
+	if (found && strcmp(found, point))
+		ret = 1;
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static void *reader(void *arg)
+{
+	unsigned long *reads = arg;
+	unsigned int num = 0;
+	struct snap *s;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+		rcu_read_lock();
+		s = rcu_dereference(snap_cur);
+		if (snap_check(s))
+			__atomic_fetch_add(&torn, 1, __ATOMIC_RELAXED);
+		/* Snapshot outlives swaps done meanwhile */
+		rcu_read_lock();
+		if (snap_check(rcu_dereference(snap_cur)) || snap_check(s))
+			__atomic_fetch_add(&torn, 1, __ATOMIC_RELAXED);
+		rcu_read_unlock();
+		rcu_read_unlock();
+
+		if (conf_check() || tab_check(num++ % STRESS_TAB))
+			__atomic_fetch_add(&torn, 1, __ATOMIC_RELAXED);
+		(*reads)++;
+	}
+
+	rcu_unregister_thread();
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[STRESS_READERS];
+	unsigned long reads[STRESS_READERS] = { 0 };
+	unsigned long total = 0, swaps = STRESS_SWAPS;
+	char dir[] = "/tmp/rcu_stress.XXXXXX";
+	char dev[32], point[32];
+	struct diskconf *conf;
+	struct snap *old;
+	uint64_t gen, start;
+	unsigned int num;
+	int i;
+
+	if (argc > 1)
+		swaps = strtoul(argv[1], NULL, 10);
+
+	/* Reloads log each pass */
+	log_level(LL_WARN);
+
+	if (!mkdtemp(dir) || chdir(dir))
+		die("Cannot create test directory");
+	conf_write(1);
+	conf_load();
+	conf_foreign = strcmp(conf_path(), "diskmount.conf");
+	if (conf_foreign)
+		warn("Config '%s' shadows test config, not checking matches", conf_path());
+
+	snap_cur = snap_new(1);
+
+	for (i = 0; i < STRESS_READERS; i++) {
+		if (pthread_create(&threads[i], NULL, reader, &reads[i]))
+			die("pthread_create() failed");
+	}
+
+	start = mono_usec();
+	for (gen = 2; gen < swaps + 2; gen++) {
+		old = snap_cur;
+		rcu_assign_pointer(snap_cur, snap_new(gen));
+		call_rcu(old, snap_free);
+
+		if (!conf_foreign && !(gen % STRESS_RELOAD)) {
+			conf_write(gen);
+			conf = conf_reload();
+			if (conf)
+				conf_release(conf);
+		}
+
+		/* Half of entries present at any time */
+		num = gen % STRESS_TAB;
+		tab_entry(num, dev, point, sizeof(dev));
+		tab_add(dev, point, makedev(STRESS_MAJOR, num), gen);
+		num = (gen + STRESS_TAB / 2) % STRESS_TAB;
+		tab_del(makedev(STRESS_MAJOR, num), 0, NULL);
+
+		rcu_reclaim();
+	}
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < STRESS_READERS; i++) {
+		pthread_join(threads[i], NULL);
+		total += reads[i];
+	}
+
+	/* No readers left, everything retired goes */
+	tab_reset();
+	rcu_reclaim();
+	snap_free(snap_cur);
+	unlink("diskmount.conf");
+	if (chdir("/") || rmdir(dir))
+		warn("Cannot remove '%s'", dir);
+
+	printf("rcu_stress: %lu swaps, %lu reads, %lu torn, %llu ms\n",
+	       swaps, total, torn,
+	       (unsigned long long)(mono_usec() - start) / 1000);
+
+	return torn ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,115 @@
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util.h"
+#include "diskev.h"
+#include "trace.h"
+
+/* Power of two, ~192KB of records */
+#define TRACE_SIZE 4096
+#define TRACE_MASK (TRACE_SIZE - 1)
+
+/*
+ * Flight recorder record. Value holds event source,
+ * matched rule number or operation duration (us).
+ */
+struct trace_rec {
+	uint64_t ts;
+	uint32_t seq;
+	uint16_t type;
+	uint16_t major;
+	uint32_t minor;
+	uint32_t val;
+	int32_t err;
+	char name[16];
+};
+
+static struct trace_rec trace_ring[TRACE_SIZE];
+static uint32_t trace_head;
+static uint64_t trace_start;
+
+static void trace_die(void)
+{
+	trace_dump(TRACE_FILE);
+}
+
+void trace_init(void)
+{
+	trace_start = mono_usec();
+	/* Fatal errors leave trace behind */
+	die_hook(trace_die);
+}
+
+void trace_event(int type, struct diskev *evt, uint32_t val, int err)
+{
+	struct trace_rec *rec;
+	const char *name;
+	uint32_t seq;
+
+	/* Claimed slot is private unless ring wraps meanwhile */
+	seq = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+	rec = &trace_ring[seq & TRACE_MASK];
+
+	rec->ts = mono_usec();
+	rec->type = type;
+	rec->major = evt->major;
+	rec->minor = evt->minor;
+	rec->val = val;
+	rec->err = err;
+	name = evt->device ? strrchr(evt->device, '/') : NULL;
+	name = name ? name + 1 : evt->device;
+	strncpy(rec->name, name ? name : "", sizeof(rec->name) - 1);
+	rec->name[sizeof(rec->name) - 1] = '\0';
+	__atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+int trace_dump(const char *file)
+{
+	static const char *names[TRACE_MAX] = {
+		[TRACE_RECV] = "recv",
+		[TRACE_COALESCE] = "coalesce",
+		[TRACE_CANCEL] = "cancel",
+		[TRACE_SANITIZE] = "sanitize",
+		[TRACE_MATCH] = "match",
+		[TRACE_NOMATCH] = "nomatch",
+		[TRACE_MOUNT] = "mount",
+		[TRACE_MOUNTED] = "mounted",
+		[TRACE_UMOUNT] = "umount",
+		[TRACE_UMOUNTED] = "umounted",
+		[TRACE_CHECK] = "check",
+		[TRACE_CHECKED] = "checked",
+	};
+	struct trace_rec *rec;
+	uint32_t head, seq, i;
+	FILE *fp;
+	int cnt = 0;
+
+	fp = fopen(file, "we");
+	if (!fp)
+		return -1;
+
+	head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	i = head > TRACE_SIZE ? head - TRACE_SIZE : 0;
+
+	fprintf(fp, "# usec seq type dev name value err\n");
+	for (; i < head; i++) {
+		rec = &trace_ring[i & TRACE_MASK];
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		/* Slot is being rewritten */
+		if (seq != i + 1)
+			continue;
+		fprintf(fp, "%llu %u %s %u:%u %s %u %i\n",
+			(unsigned long long)(rec->ts - trace_start), rec->seq,
+			rec->type < TRACE_MAX && names[rec->type] ? names[rec->type] : "?",
+			rec->major, rec->minor, rec->name, rec->val, rec->err);
+		cnt++;
+	}
+
+	fclose(fp);
+
+	vinfo("Dumped %i trace records to '%s'", cnt, file);
+
+	return cnt;
+}
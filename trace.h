@@ -0,0 +1,36 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+#include "diskev.h"
+
+#define TRACE_FILE "/var/run/diskmount.trace"
+
+#define TRACE_RECV 1
+#define TRACE_COALESCE 2
+#define TRACE_CANCEL 3
+#define TRACE_SANITIZE 4
+#define TRACE_MATCH 5
+#define TRACE_NOMATCH 6
+#define TRACE_MOUNT 7
+#define TRACE_MOUNTED 8
+#define TRACE_UMOUNT 9
+#define TRACE_UMOUNTED 10
+#define TRACE_CHECK 11
+#define TRACE_CHECKED 12
+#define TRACE_MAX 13
+
+/* Event sources, TRACE_RECV and TRACE_SANITIZE value */
+#define TRACE_SRC_KERNEL 0
+#define TRACE_SRC_UDEV 1
+#define TRACE_SRC_LOCAL 2
+#define TRACE_SRC_SPOOL 3
+#define TRACE_SRC_SCAN 4
+#define TRACE_SRC_PROBE 5
+
+void trace_init(void);
+void trace_event(int type, struct diskev *evt, uint32_t val, int err);
+int trace_dump(const char *file);
+
+#endif // _TRACE_H
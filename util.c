@@ -1,4 +1,5 @@
 
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -7,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
@@ -55,8 +57,16 @@ char *strfdup(const char *format, ... )
 	return strdup(buf);
 }
 
+static void (*die_fn)(void);
+
+void die_hook(void (*fn)(void))
+{
+	die_fn = fn;
+}
+
 void __noreturn die(const char *format, ... )
 {
+	void (*fn)(void) = die_fn;
 	int saved = errno;
 
 	if (format != NULL) {
@@ -72,6 +82,11 @@ void __noreturn die(const char *format, ... )
 	else
 		fprintf(stderr, "\n");
 
+	/* Hook may fail and die again */
+	die_fn = NULL;
+	if (fn)
+		fn();
+
 	exit(1);
 }
 
@@ -159,6 +174,7 @@ void syslog_close(void)
 	closelog();
 }
 
+/* Returns allocated link name, caller frees it */
 static char *get_disk_prop(const char *type, const char *disk)
 {
 	struct dirent *dp;
@@ -169,7 +185,6 @@ static char *get_disk_prop(const char *type, const char *disk)
 	char real[128];
 	char *file = path;
 	char *res = NULL;
-	char buf[64];
 
 	file += sprintf(path, "/dev/disk/%s", type);
 
@@ -198,8 +213,9 @@ static char *get_disk_prop(const char *type, const char *disk)
 		if (strcmp(real, disk))
 			continue;
 
-		strcpy(buf, dp->d_name);
-		res = buf;
+		res = strdup(dp->d_name);
+		if (!res)
+			die("strdup() failed");
 		break;
 	}
 
@@ -216,3 +232,98 @@ char *get_disk_partuuid(const char *disk)
 {
 	return get_disk_prop("by-partuuid", disk);
 }
+
+unsigned long long get_disk_seq(unsigned int major, unsigned int minor)
+{
+	FILE *fp;
+	char path[64];
+	unsigned long long seq = 0;
+
+	/* Partitions inherit sequence of parent disk */
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/diskseq", major, minor);
+	fp = fopen(path, "r");
+	if (!fp) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../diskseq", major, minor);
+		fp = fopen(path, "r");
+	}
+	if (!fp)
+		return 0;
+
+	if (fscanf(fp, "%llu", &seq) != 1)
+		seq = 0;
+	fclose(fp);
+
+	return seq;
+}
+
+uint32_t hash_str(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*str)
+		hash = (hash ^ (unsigned char)*str++) * 16777619u;
+
+	return hash;
+}
+
+uint32_t hash_buf(const void *buf, size_t len)
+{
+	const unsigned char *pos = buf;
+	uint32_t hash = 2166136261u;
+
+	while (len--)
+		hash = (hash ^ *pos++) * 16777619u;
+
+	return hash;
+}
+
+uint32_t hash_u64(uint64_t val)
+{
+	val ^= val >> 33;
+	val *= 0xff51afd7ed558ccdULL;
+	val ^= val >> 33;
+	val *= 0xc4ceb9fe1a85ec53ULL;
+	val ^= val >> 33;
+
+	return (uint32_t)val;
+}
+
+uint64_t mono_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Path lies below directory */
+int path_under(const char *path, const char *dir)
+{
+	size_t len = strlen(dir);
+
+	while (len && dir[len - 1] == '/')
+		len--;
+
+	return !strncmp(path, dir, len) && path[len] == '/' && path[len + 1];
+}
+
+/* Kernel names partitions "<disk><n>", "<disk>p<n>" if disk ends in digit */
+int dev_is_part(const char *part, const char *disk)
+{
+	size_t len = strlen(disk);
+
+	if (!len || strncmp(part, disk, len))
+		return 0;
+	part += len;
+	if (isdigit((unsigned char)disk[len - 1]) && *part++ != 'p')
+		return 0;
+	if (!*part)
+		return 0;
+	for (; *part; part++) {
+		if (!isdigit((unsigned char)*part))
+			return 0;
+	}
+
+	return 1;
+}
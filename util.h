@@ -1,6 +1,7 @@
 #ifndef _UTIL_H
 #define _UTIL_H
 
+#include <stdint.h>
 #include <stdio.h>
 
 #define __noreturn __attribute__((noreturn))
@@ -30,6 +31,7 @@ void set_nio(int fd);
 
 char *strfdup(const char *format, ... ) __print_format(1, 2);
 void __noreturn die(const char *msg, ...) __print_format(1, 2);
+void die_hook(void (*fn)(void));
 
 void log_print(int lvl, char *fmt, ...) __print_format(2, 3);
 void log_level(int lvl);
@@ -40,5 +42,12 @@ void syslog_open(void);
 void syslog_close(void);
 char *get_disk_uuid(const char *disk);
 char *get_disk_partuuid(const char *disk);
+unsigned long long get_disk_seq(unsigned int major, unsigned int minor);
+uint32_t hash_str(const char *str);
+uint32_t hash_buf(const void *buf, size_t len);
+uint32_t hash_u64(uint64_t val);
+uint64_t mono_usec(void);
+int path_under(const char *path, const char *dir);
+int dev_is_part(const char *part, const char *disk);
 
 #endif // _UTIL_H
@@ -0,0 +1,280 @@
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include "list.h"
+#include "rcu.h"
+#include "util.h"
+#include "workq.h"
+
+struct workq {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Submitted, running and finished works */
+	struct list_head pending;
+	struct list_head running;
+	struct list_head done;
+	pthread_t *threads;
+	int nthreads;
+	int inflight;
+	int stop;
+	/* Wakes event loop on completion */
+	int efd;
+};
+
+static struct workq wq = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.pending = LIST_HEAD_INIT(wq.pending),
+	.running = LIST_HEAD_INIT(wq.running),
+	.done = LIST_HEAD_INIT(wq.done),
+	.efd = -1,
+};
+
+static int work_keys_conflict(uint32_t *a, uint32_t *b)
+{
+	int i, j;
+
+	for (i = 0; i < WORK_KEYS; i++) {
+		if (!a[i])
+			continue;
+		for (j = 0; j < WORK_KEYS; j++)
+			if (a[i] == b[j])
+				return 1;
+	}
+
+	return 0;
+}
+
+static int work_list_conflict(struct list_head *head, struct work *stop,
+			      uint32_t *keys)
+{
+	struct work *w;
+
+	list_for_each_entry(w, head, list) {
+		if (w == stop)
+			break;
+		if (work_keys_conflict(keys, w->keys))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* First pending work not ordered behind another one */
+static struct work *workq_pick(void)
+{
+	struct work *w;
+
+	list_for_each_entry(w, &wq.pending, list) {
+		if (work_list_conflict(&wq.running, NULL, w->keys))
+			continue;
+		if (work_list_conflict(&wq.pending, w, w->keys))
+			continue;
+		return w;
+	}
+
+	return NULL;
+}
+
+static void *workq_worker(void *arg)
+{
+	struct work *w;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&wq.lock);
+	for (;;) {
+		w = workq_pick();
+		if (!w) {
+			if (wq.stop && list_empty(&wq.pending))
+				break;
+			pthread_cond_wait(&wq.cond, &wq.lock);
+			continue;
+		}
+
+		list_move_tail(&w->list, &wq.running);
+		pthread_mutex_unlock(&wq.lock);
+
+		w->run(w);
+
+		pthread_mutex_lock(&wq.lock);
+		list_move_tail(&w->list, &wq.done);
+		/* Ordered works may be runnable now */
+		pthread_cond_broadcast(&wq.cond);
+		if (write(wq.efd, &one, sizeof(one)) < 0)
+			vwarn("Failed to signal work completion");
+	}
+	pthread_mutex_unlock(&wq.lock);
+
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+/* Returns completion fd to be polled by event loop */
+int workq_init(int nthreads)
+{
+	int i;
+
+	if (nthreads <= 0)
+		return -1;
+
+	wq.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wq.efd < 0) {
+		warn("Cannot create work queue eventfd: %s", strerror(errno));
+		return -1;
+	}
+
+	wq.threads = calloc(nthreads, sizeof(*wq.threads));
+	if (!wq.threads)
+		die("malloc() failed");
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&wq.threads[i], NULL, workq_worker, NULL)) {
+			verror("Failed to start worker thread");
+			break;
+		}
+		wq.nthreads++;
+	}
+
+	if (!wq.nthreads) {
+		free(wq.threads);
+		close(wq.efd);
+		wq.efd = -1;
+		return -1;
+	}
+
+	vinfo("Started %i workers", wq.nthreads);
+
+	return wq.efd;
+}
+
+/*
+ * Without timeout lets workers finish submitted works and joins
+ * them. With timeout pending works are canceled and running ones
+ * get until deadline; workers past it are left behind along with
+ * queue state. Returns number of such workers.
+ */
+int workq_stop(unsigned int timeout_ms)
+{
+	struct work *w, *tmp;
+	struct timespec ts;
+	int i, left = 0;
+
+	if (!wq.nthreads)
+		return 0;
+
+	/* Joins wait on realtime clock */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += timeout_ms % 1000 * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&wq.lock);
+	wq.stop = 1;
+	if (timeout_ms) {
+		list_for_each_entry_safe(w, tmp, &wq.pending, list) {
+			w->canceled = 1;
+			list_move_tail(&w->list, &wq.done);
+		}
+	}
+	pthread_cond_broadcast(&wq.cond);
+	pthread_mutex_unlock(&wq.lock);
+
+	for (i = 0; i < wq.nthreads; i++) {
+		if (!timeout_ms) {
+			pthread_join(wq.threads[i], NULL);
+		} else if (pthread_timedjoin_np(wq.threads[i], NULL, &ts)) {
+			pthread_detach(wq.threads[i]);
+			left++;
+		}
+	}
+
+	/* Canceled works are handed back even so */
+	if (left) {
+		verror("%i workers missed stop deadline", left);
+		workq_complete();
+		return left;
+	}
+
+	free(wq.threads);
+	wq.threads = NULL;
+	wq.nthreads = 0;
+
+	workq_complete();
+	close(wq.efd);
+	wq.efd = -1;
+
+	return 0;
+}
+
+void workq_submit(struct work *w)
+{
+	/* No workers, run inline */
+	if (!wq.nthreads) {
+		w->run(w);
+		w->done(w);
+		return;
+	}
+
+	pthread_mutex_lock(&wq.lock);
+	list_add_tail(&w->list, &wq.pending);
+	wq.inflight++;
+	pthread_cond_signal(&wq.cond);
+	pthread_mutex_unlock(&wq.lock);
+}
+
+/* Keys are held until completion is handled by event loop */
+int workq_busy(uint32_t *keys)
+{
+	int busy;
+
+	if (!wq.nthreads)
+		return 0;
+
+	pthread_mutex_lock(&wq.lock);
+	busy = work_list_conflict(&wq.pending, NULL, keys) ||
+		work_list_conflict(&wq.running, NULL, keys) ||
+		work_list_conflict(&wq.done, NULL, keys);
+	pthread_mutex_unlock(&wq.lock);
+
+	return busy;
+}
+
+int workq_idle(void)
+{
+	return !wq.inflight;
+}
+
+void workq_complete(void)
+{
+	LLIST_HEAD(done);
+	struct work *w, *tmp;
+	uint64_t cnt;
+
+	if (wq.efd < 0)
+		return;
+
+	if (read(wq.efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		vwarn("Failed to read work completions");
+
+	/* Keys are released once works leave done list */
+	pthread_mutex_lock(&wq.lock);
+	list_splice_init(&wq.done, &done);
+	pthread_mutex_unlock(&wq.lock);
+
+	list_for_each_entry_safe(w, tmp, &done, list) {
+		list_del(&w->list);
+		w->done(w);
+		wq.inflight--;
+	}
+}
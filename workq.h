@@ -0,0 +1,31 @@
+#ifndef _WORKQ_H
+#define _WORKQ_H
+
+#include <stdint.h>
+
+#include "list.h"
+
+#define WORK_KEYS 3
+
+/*
+ * Work item, run() is called on worker thread, done()
+ * on event loop thread from workq_complete(). Works
+ * sharing any non-zero key are run in submit order.
+ * Works dropped on stop get done() with canceled set.
+ */
+struct work {
+	uint32_t keys[WORK_KEYS];
+	void (*run)(struct work *w);
+	void (*done)(struct work *w);
+	int canceled;
+	struct list_head list;
+};
+
+int workq_init(int nthreads);
+int workq_stop(unsigned int timeout_ms);
+void workq_submit(struct work *w);
+int workq_busy(uint32_t *keys);
+int workq_idle(void);
+void workq_complete(void);
+
+#endif // _WORKQ_H